@@ -0,0 +1,239 @@
+// Copyright (C) 2010 Masahiko Higashiyama
+//
+// Permission is hereby granted, free of charge, to any person obtaining a
+// copy of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#ifndef ARENA_HPP
+#define ARENA_HPP
+
+#include <pthread.h>
+#include <cstdlib>
+#include <cstddef>
+#include <new>
+#include <vector>
+
+namespace nanase {
+  // Bump allocator for the temporaries of one query. Memory is given
+  // back all at once by rewinding to a Mark; up to MAX_SPARE_BLOCKS
+  // blocks are kept for the next query, so in the steady state a query
+  // does not call malloc, while a thread does not hold on to the memory
+  // of its largest query.
+  // An Arena must only be used by one thread, see for_thread().
+  class Arena {
+    struct Block {
+      size_t size;
+      size_t used;
+      char *data(){ return reinterpret_cast<char *>(this + 1); }
+    };
+
+    static const size_t BLOCK_SIZE = 64 * 1024;
+    static const size_t ALIGN = 16;
+    static const size_t MAX_SPARE_BLOCKS = 4;
+
+    std::vector<Block *> blocks;
+    size_t cur;
+    size_t nmalloc;
+    size_t depth;
+
+    friend class ArenaScope;
+
+    Arena(const Arena &);
+    Arena &operator=(const Arena &);
+
+    static void DeleteArena(void *arena){
+      delete reinterpret_cast<Arena *>(arena);
+    }
+
+    static pthread_key_t &Key(){
+      static pthread_key_t key;
+      return key;
+    }
+
+    static void CreateKey(){
+      pthread_key_create(&Key(), DeleteArena);
+    }
+
+    Block *NewBlock(size_t size){
+      void *p = malloc(sizeof(Block) + size);
+      if(p == NULL) throw std::bad_alloc();
+      nmalloc++;
+      Block *b = reinterpret_cast<Block *>(p);
+      b->size = size;
+      b->used = 0;
+      return b;
+    }
+
+    // Called when the outermost scope has rewound: gives blocks larger
+    // than BLOCK_SIZE, and spare blocks over MAX_SPARE_BLOCKS, back to
+    // malloc.
+    void Trim(){
+      size_t keep = 0;
+      for(size_t i = 0; i < blocks.size(); i++){
+        bool in_use = i < cur || (i == cur && blocks[i]->used > 0);
+        if(in_use || (blocks[i]->size <= BLOCK_SIZE &&
+                      keep < cur + MAX_SPARE_BLOCKS)){
+          blocks[keep++] = blocks[i];
+        }else{
+          free(blocks[i]);
+        }
+      }
+      blocks.resize(keep);
+      if(cur >= keep) cur = 0;
+    }
+
+  public:
+    struct Mark {
+      size_t block;
+      size_t used;
+    };
+
+    Arena() : cur(0), nmalloc(0), depth(0) {}
+
+    ~Arena(){
+      for(size_t i = 0; i < blocks.size(); i++) free(blocks[i]);
+    }
+
+    // The arena of the calling thread, deleted when the thread exits.
+    static Arena &for_thread(){
+      static pthread_once_t once = PTHREAD_ONCE_INIT;
+      pthread_once(&once, CreateKey);
+      Arena *arena = reinterpret_cast<Arena *>(pthread_getspecific(Key()));
+      if(arena == NULL){
+        arena = new Arena();
+        pthread_setspecific(Key(), arena);
+      }
+      return *arena;
+    }
+
+    void *allocate(size_t n){
+      n = (n + ALIGN - 1) & ~(ALIGN - 1);
+      while(cur < blocks.size()){
+        Block *b = blocks[cur];
+        if(b->size - b->used >= n){
+          void *p = b->data() + b->used;
+          b->used += n;
+          return p;
+        }
+        if(cur + 1 == blocks.size()) break;
+        blocks[++cur]->used = 0;
+      }
+      // Blocks after cur are spare ones kept by rewind, a new block goes
+      // before them.
+      Block *b = NewBlock(n > BLOCK_SIZE ? n : BLOCK_SIZE);
+      if(!blocks.empty()) cur++;
+      blocks.insert(blocks.begin() + cur, b);
+      b->used = n;
+      return b->data();
+    }
+
+    Mark mark() const {
+      Mark m;
+      m.block = cur;
+      m.used = blocks.empty() ? 0 : blocks[cur]->used;
+      return m;
+    }
+
+    // Frees everything allocated since the mark was taken.
+    void rewind(const Mark &m){
+      if(blocks.empty()) return;
+      cur = m.block;
+      blocks[cur]->used = m.used;
+    }
+
+    // Number of malloc calls made so far.
+    size_t malloc_count() const { return nmalloc; }
+  };
+
+  // Rewinds the arena to where it was when the scope was entered. The
+  // outermost scope also trims the blocks kept for reuse.
+  class ArenaScope {
+    Arena &arena;
+    Arena::Mark m;
+    ArenaScope(const ArenaScope &);
+    ArenaScope &operator=(const ArenaScope &);
+  public:
+    ArenaScope(Arena &_arena) : arena(_arena), m(_arena.mark()) {
+      arena.depth++;
+    }
+    ~ArenaScope(){
+      arena.rewind(m);
+      if(--arena.depth == 0) arena.Trim();
+    }
+  };
+
+  // STL allocator drawing from an Arena. Without an arena it falls back
+  // to operator new, so containers which outlive a query can share the
+  // same type.
+  template <typename T>
+  class ArenaAllocator {
+  public:
+    typedef T value_type;
+    typedef T *pointer;
+    typedef const T *const_pointer;
+    typedef T &reference;
+    typedef const T &const_reference;
+    typedef size_t size_type;
+    typedef ptrdiff_t difference_type;
+
+    template <typename U>
+    struct rebind {
+      typedef ArenaAllocator<U> other;
+    };
+
+    Arena *arena;
+
+    ArenaAllocator(Arena *_arena = NULL) throw() : arena(_arena) {}
+
+    template <typename U>
+    ArenaAllocator(const ArenaAllocator<U> &other) throw()
+      : arena(other.arena) {}
+
+    pointer address(reference x) const { return &x; }
+    const_pointer address(const_reference x) const { return &x; }
+
+    pointer allocate(size_type n, const void * = 0){
+      if(arena == NULL)
+        return reinterpret_cast<pointer>(::operator new(n * sizeof(T)));
+      return reinterpret_cast<pointer>(arena->allocate(n * sizeof(T)));
+    }
+
+    void deallocate(pointer p, size_type){
+      if(arena == NULL) ::operator delete(p);
+    }
+
+    size_type max_size() const throw() {
+      return static_cast<size_type>(-1) / sizeof(T);
+    }
+
+    void construct(pointer p, const T &val){ new(p) T(val); }
+    void destroy(pointer p){ p->~T(); }
+  };
+
+  template <typename T, typename U>
+  bool operator==(const ArenaAllocator<T> &a, const ArenaAllocator<U> &b){
+    return a.arena == b.arena;
+  }
+
+  template <typename T, typename U>
+  bool operator!=(const ArenaAllocator<T> &a, const ArenaAllocator<U> &b){
+    return a.arena != b.arena;
+  }
+};
+
+#endif /* ARENA_HPP */
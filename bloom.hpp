@@ -0,0 +1,168 @@
+// Copyright (C) 2010 Masahiko Higashiyama
+//
+// Permission is hereby granted, free of charge, to any person obtaining a
+// copy of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#ifndef BLOOM_HPP
+#define BLOOM_HPP
+
+#include <stdint.h>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+namespace nanase {
+  // Bloom filter over index keys. IndexDB consults it before touching the
+  // hash database so lookups of bigrams which were never indexed cost no
+  // hash probe and no disk seek.
+  class BloomFilter {
+    std::vector<uint64_t> words;
+    uint64_t mask;
+    unsigned int nhash;
+
+    static const char *Magic(){ return "NNSBLOOM"; }
+
+    static uint64_t Hash(const void *key, size_t len){
+      // FNV-1a followed by the murmur3 finalizer.
+      const unsigned char *p = reinterpret_cast<const unsigned char *>(key);
+      uint64_t h = 14695981039346656037ULL;
+      for(size_t i = 0; i < len; i++){
+        h ^= p[i];
+        h *= 1099511628211ULL;
+      }
+      h ^= h >> 33;
+      h *= 0xff51afd7ed558ccdULL;
+      h ^= h >> 33;
+      h *= 0xc4ceb9fe1a85ec53ULL;
+      h ^= h >> 33;
+      return h;
+    }
+
+    BloomFilter(const BloomFilter &);
+    BloomFilter &operator=(const BloomFilter &);
+
+  public:
+    static const size_t DEFAULT_BITS = 1 << 23;
+    static const unsigned int DEFAULT_HASHES = 7;
+
+    // Number of bits for about 1% false positive rate with n keys.
+    static size_t BitsFor(size_t n){
+      size_t bits = DEFAULT_BITS;
+      while(bits < n * 10) bits <<= 1;
+      return bits;
+    }
+
+    BloomFilter(size_t nbits = DEFAULT_BITS,
+                unsigned int _nhash = DEFAULT_HASHES) {
+      reset(nbits, _nhash);
+    }
+
+    // nbits is rounded up to a power of two.
+    void reset(size_t nbits, unsigned int _nhash = DEFAULT_HASHES){
+      size_t bits = 64;
+      while(bits < nbits) bits <<= 1;
+      words.assign(bits / 64, 0);
+      mask = bits - 1;
+      nhash = _nhash;
+    }
+
+    void add(const void *key, size_t len){
+      uint64_t h = Hash(key, len);
+      uint64_t h2 = (h >> 32) | 1;
+      for(unsigned int i = 0; i < nhash; i++, h += h2){
+        uint64_t bit = h & mask;
+        uint64_t *w = &words[bit >> 6];
+        uint64_t b = 1ULL << (bit & 63);
+        if(!(*w & b)) __sync_fetch_and_or(w, b);
+      }
+    }
+
+    bool maybe_contains(const void *key, size_t len) const {
+      uint64_t h = Hash(key, len);
+      uint64_t h2 = (h >> 32) | 1;
+      for(unsigned int i = 0; i < nhash; i++, h += h2){
+        uint64_t bit = h & mask;
+        if(!(words[bit >> 6] & (1ULL << (bit & 63)))) return false;
+      }
+      return true;
+    }
+
+    size_t bits() const { return words.size() * 64; }
+
+    // Ratio of set bits. Above one half the filter stops paying off.
+    double fill_ratio() const {
+      size_t n = 0;
+      for(size_t i = 0; i < words.size(); i++)
+        n += __builtin_popcountll(words[i]);
+      return static_cast<double>(n) / static_cast<double>(bits());
+    }
+
+    // The stamp lets the owner detect a filter which is older than
+    // its index (e.g. the process died before saving it).
+    bool load(const std::string &path, int *stamp){
+      FILE *fp = fopen(path.c_str(), "rb");
+      if(fp == NULL) return false;
+      char magic[8];
+      uint32_t _nhash;
+      int32_t _stamp;
+      uint64_t nwords;
+      bool ok = fread(magic, sizeof(magic), 1, fp) == 1
+        && memcmp(magic, Magic(), sizeof(magic)) == 0
+        && fread(&_nhash, sizeof(_nhash), 1, fp) == 1
+        && fread(&_stamp, sizeof(_stamp), 1, fp) == 1
+        && fread(&nwords, sizeof(nwords), 1, fp) == 1
+        && nwords > 0 && (nwords & (nwords - 1)) == 0;
+      if(ok){
+        std::vector<uint64_t> w(nwords);
+        ok = fread(&w[0], sizeof(uint64_t), nwords, fp) == nwords;
+        if(ok){
+          words.swap(w);
+          mask = nwords * 64 - 1;
+          nhash = _nhash;
+          *stamp = _stamp;
+        }
+      }
+      fclose(fp);
+      return ok;
+    }
+
+    // Written to a temporary file and renamed, so a crash never leaves
+    // a truncated filter behind.
+    bool save(const std::string &path, int stamp) const {
+      std::string tmp = path + ".tmp";
+      FILE *fp = fopen(tmp.c_str(), "wb");
+      if(fp == NULL) return false;
+      uint32_t _nhash = nhash;
+      int32_t _stamp = stamp;
+      uint64_t nwords = words.size();
+      bool ok = fwrite(Magic(), 8, 1, fp) == 1
+        && fwrite(&_nhash, sizeof(_nhash), 1, fp) == 1
+        && fwrite(&_stamp, sizeof(_stamp), 1, fp) == 1
+        && fwrite(&nwords, sizeof(nwords), 1, fp) == 1
+        && fwrite(&words[0], sizeof(uint64_t), nwords, fp) == nwords;
+      ok = (fclose(fp) == 0) && ok;
+      if(ok) ok = rename(tmp.c_str(), path.c_str()) == 0;
+      if(!ok) remove(tmp.c_str());
+      return ok;
+    }
+  };
+};
+
+#endif /* BLOOM_HPP */
@@ -0,0 +1,108 @@
+// Copyright (C) 2010 Masahiko Higashiyama
+//
+// Permission is hereby granted, free of charge, to any person obtaining a
+// copy of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifndef BUDGET_HPP
+#define BUDGET_HPP
+
+#include <time.h>
+#include <cstddef>
+
+namespace nanase {
+  // Limits of the work one query may do. A limit of 0 means unlimited.
+  // Once a limit is hit the budget is exhausted and the searcher stops
+  // at its next check, returning what it has found so far. Checks are an
+  // atomic add and, with a deadline, a coarse clock read, so they can
+  // be made from the inner loops and from several threads at once.
+  //
+  // A budget is for one query: it keeps the work done by it.
+  class QueryBudget {
+    struct timespec deadline;
+    bool has_deadline;
+    size_t max_postings;
+    size_t max_docinfos;
+    size_t postings;
+    size_t docinfos;
+    int exhausted_flag;
+
+    static void Now(struct timespec *ts){
+#ifdef CLOCK_MONOTONIC_COARSE
+      clock_gettime(CLOCK_MONOTONIC_COARSE, ts);
+#else
+      clock_gettime(CLOCK_MONOTONIC, ts);
+#endif
+    }
+
+    bool Exhaust(){
+      __sync_lock_test_and_set(&exhausted_flag, 1);
+      return false;
+    }
+
+    bool CheckDeadline(){
+      if(!has_deadline) return true;
+      struct timespec now;
+      Now(&now);
+      if(now.tv_sec > deadline.tv_sec
+         || (now.tv_sec == deadline.tv_sec && now.tv_nsec >= deadline.tv_nsec))
+        return Exhaust();
+      return true;
+    }
+
+  public:
+    QueryBudget(unsigned int timeout_ms = 0, size_t _max_postings = 0,
+                size_t _max_docinfos = 0)
+      : has_deadline(timeout_ms > 0), max_postings(_max_postings),
+        max_docinfos(_max_docinfos), postings(0), docinfos(0),
+        exhausted_flag(0) {
+      Now(&deadline);
+      deadline.tv_nsec += (timeout_ms % 1000) * 1000000L;
+      deadline.tv_sec += timeout_ms / 1000 + deadline.tv_nsec / 1000000000L;
+      deadline.tv_nsec %= 1000000000L;
+    }
+
+    // Each returns false if the budget is exhausted.
+    bool check(){
+      return !exhausted() && CheckDeadline();
+    }
+
+    bool charge_postings(size_t n){
+      size_t total = __sync_add_and_fetch(&postings, n);
+      if(max_postings > 0 && total > max_postings) return Exhaust();
+      return check();
+    }
+
+    // Running out of postings does not stop the matches found so far
+    // from being scored.
+    bool charge_docinfo(){
+      size_t total = __sync_add_and_fetch(&docinfos, 1);
+      if(max_docinfos > 0 && total > max_docinfos) return Exhaust();
+      return CheckDeadline();
+    }
+
+    // Whether a limit was hit, so that the results are partial.
+    bool exhausted() const {
+      return __sync_fetch_and_add(const_cast<int *>(&exhausted_flag), 0);
+    }
+
+    size_t postings_used() const { return postings; }
+    size_t docinfos_used() const { return docinfos; }
+  };
+};
+
+#endif /* BUDGET_HPP */
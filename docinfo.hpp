@@ -23,6 +23,7 @@
 #define DOCINFO_HPP
 
 #include <cstring>
+#include "arena.hpp"
 
 namespace nanase {
   struct DocInfo {
@@ -33,24 +34,32 @@ namespace nanase {
     size_t titlelen;
     char *url;
     char *title;
+    // If set, deserialize allocates url and title from it.
+    Arena *arena;
 
     DocInfo(const DocInfo &);
     DocInfo &operator=(const DocInfo &);
 
-    DocInfo(int _docid)
+    char *NewString(size_t len){
+      if(arena != NULL) return reinterpret_cast<char *>(arena->allocate(len));
+      return new char[len];
+    }
+
+    DocInfo(int _docid, Arena *_arena = NULL)
       : docid(_docid),  wordnum(0), urllen(0), titlelen(0),
-        url(NULL), title(NULL)  { }
+        url(NULL), title(NULL), arena(_arena)  { }
 
     DocInfo(int _docid, const char *_url, const char *_title)
       : docid(_docid),
         urllen(sizeof(char) * strlen(_url)),
         titlelen(sizeof(char) * strlen(_title)),
-        url(new char[urllen]), title(new char[titlelen]) {
+        url(new char[urllen]), title(new char[titlelen]), arena(NULL) {
       memcpy(url, _url, urllen);
       memcpy(title, _title, titlelen);
     }
 
     ~DocInfo(){
+      if(arena != NULL) return;
       if(url != NULL) delete[] url;
       if(title != NULL) delete[] title;
     }
@@ -93,14 +102,14 @@ namespace nanase {
       offset += sizeof(size_t);
 
       if(urllen > 0){
-        url = new char[urllen + 1];
+        url = NewString(urllen + 1);
         memcpy(url, data + offset, sizeof(char) * urllen);
         url[urllen] = '\0';
         offset += sizeof(char) * urllen;
       }
 
       if(titlelen > 0){
-        title = new char[titlelen + 1];
+        title = NewString(titlelen + 1);
         memcpy(title, data + offset, sizeof(char) * titlelen);
         title[titlelen] = '\0';
       }
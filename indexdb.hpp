@@ -23,67 +23,375 @@
 
 #include <string>
 #include <cstring>
+#include <fstream>
+#include <stdint.h>
 
-#include <map>
+#include <vector>
+#include <set>
+#include <algorithm>
+#include <functional>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include "serializer.hpp"
 #include "tcmanager.hpp"
 #include "docinfo.hpp"
+#include "posting.hpp"
+#include "bloom.hpp"
+#include "writebuffer.hpp"
 #include "constants.hpp"
 
 
 namespace nanase {
   class IndexDB {
-    typedef int DocumentID;
-    typedef size_t Position;
-    typedef std::multimap<DocumentID, Position> IdxType;
-
     TCManager tcm;
+    mutable BloomFilter bloom;
+    std::string bloom_path;
+    std::string hot_path;
+    mutable WriteBuffer buffer;
+
+    // Documents are committed in docid order: committed is the largest
+    // docid such that every document up to it has been completely
+    // written. Writers serialize on docid_mutex, readers only load
+    // committed.
+    mutable pthread_mutex_t docid_mutex;
+    mutable std::set<int> inflight;
+    mutable int last_docid;
+    mutable int committed;
+    // Documents which failed half way. Their postings stay in the index,
+    // so searchers drop them (see aborted_docids). Kept in the database
+    // too, under AbortedKey.
+    mutable std::set<int> aborted;
+    bool store_text;
 
     IndexDB(const IndexDB &);
     IndexDB& operator=(const IndexDB &);
 
+    // Keys of text blocks: prefix, docid and block number. No bigram
+    // key has this size with a one byte first character, so they cannot
+    // be confused with index keys.
+    static const char *TextPrefix(){ return "\x01\x03"; }
+    // Two one byte characters followed by more bytes, so it cannot be an
+    // index key either.
+    static const char *AbortedKey(){ return "\x01\x01" "aborted"; }
+
+    void LoadAborted(){
+      aborted.clear();
+      ReadBuffer &buf = ReadBuffer::for_thread();
+      int n = tcm.read(AbortedKey(), strlen(AbortedKey()), buf);
+      size_t size = (n < 0) ? 0 : n;
+      for(size_t i = 0; i + sizeof(int) <= size; i += sizeof(int)){
+        int docid;
+        memcpy(&docid, buf.data() + i, sizeof(int));
+        aborted.insert(docid);
+      }
+      buf.shrink();
+    }
+    static const size_t TEXT_KEY_SIZE = sizeof(unsigned char) * 2
+      + sizeof(int) * 2;
+
+    // The filter is only trusted if it was saved when the index was at
+    // the same docid, otherwise (or when it got too full) it is rebuilt
+    // by scanning all keys.
+    void LoadBloom(){
+      int stamp;
+      if(bloom.load(bloom_path, &stamp) && stamp == get_current_docid()
+         && bloom.fill_ratio() < 0.5)
+        return;
+
+      bloom.reset(BloomFilter::BitsFor(tcm.rnum()));
+      tcm.iterinit();
+      void *key;
+      int ksiz;
+      while((key = tcm.iternext(&ksiz)) != NULL){
+        bloom.add(key, ksiz);
+        free(key);
+      }
+    }
+
+    // Appends the records to m.
+    static void DecodePostings(const void *data, size_t n, PostingList &m){
+      PostingView view(data, n);
+      m.reserve(m.size() + view.size());
+      bool sorted = true;
+      for(size_t i = 0; i < view.size(); i++){
+        Posting p = view[i];
+        if(!m.empty() && p < m.back()) sorted = false;
+        m.push_back(p);
+      }
+
+      // Records are appended in docid order by a single indexer,
+      // but concurrent indexers may interleave them.
+      if(!sorted) std::sort(m.begin(), m.end());
+    }
+
+    // Postings of the key, from the database and the write buffer.
+    // They are read into the buffer of the thread and decoded from
+    // there, so only the list itself is allocated.
+    PostingList ReadPostings(const void *key, int ksiz,
+                             const PostingAllocator &alloc) const {
+      PostingList m(alloc);
+      ReadBuffer &buf = ReadBuffer::for_thread();
+      if(!buffer.enabled()){
+        int n = tcm.read(key, ksiz, buf);
+        if(n > 0) DecodePostings(buf.data(), n, m);
+        buf.shrink();
+        return m;
+      }
+
+      std::string buffered;
+      int n;
+      {
+        WriteBuffer::ReadLock lock(buffer);
+        n = tcm.read(key, ksiz, buf);
+        buffer.lookup(key, ksiz, buffered);
+      }
+      if(n > 0) DecodePostings(buf.data(), n, m);
+      buf.shrink();
+      if(!buffered.empty())
+        DecodePostings(buffered.data(), buffered.size(), m);
+      return m;
+    }
+
   public:
-    IndexDB(const std::string &db_path){
+    IndexDB(const std::string &db_path) : buffer(tcm), store_text(false) {
+      pthread_mutex_init(&docid_mutex, NULL);
       open(db_path);
     }
 
+    ~IndexDB(){
+      pthread_mutex_destroy(&docid_mutex);
+    }
+
     void open(const std::string &db_path){
       tcm.open(db_path.c_str());
+      bloom_path = db_path + ".bloom";
+      hot_path = db_path + ".hot";
+      LoadBloom();
+      LoadAborted();
+      inflight.clear();
+      last_docid = committed = get_current_docid();
+    }
+
+    // Makes appended postings go to an in-memory buffer, which is
+    // searchable at once and written to the database in the background
+    // when it holds max_bytes or its oldest record is max_age_ms old.
+    // max_bytes == 0 turns buffering off (postings are appended to the
+    // database directly, which is the default).
+    void set_write_buffer(size_t max_bytes, unsigned int max_age_ms){
+      buffer.stop();
+      if(max_bytes > 0) buffer.start(max_bytes, max_age_ms);
+    }
+
+    void flush() const {
+      buffer.flush();
     }
 
     void close(){
+      buffer.stop();
+      // The filter is a cache, if it cannot be saved it is rebuilt
+      // at the next open.
+      if(!bloom.save(bloom_path, get_current_docid()))
+        remove(bloom_path.c_str());
       tcm.close();
     }
 
+    bool may_contain_index(const char *sub, const char *ns = "") const {
+      return may_contain_index(sub, strlen(sub), ns);
+    }
+
+    bool may_contain_index(const char *sub, size_t sublen,
+                           const char *ns = "") const {
+      using namespace serializer;
+      Serializer key(strlen(ns) + sublen);
+      key << PtrCon(ns, strlen(ns)) << PtrCon(sub, sublen);
+      return bloom.maybe_contains(key.data(), key.size());
+    }
+
     void append_index(const char *sub, int docid, size_t pos,
                       const char *ns = "") const {
+      append_index(sub, strlen(sub), docid, pos, ns);
+    }
+
+    // sub may contain NUL characters.
+    void append_index(const char *sub, size_t sublen, int docid, size_t pos,
+                      const char *ns = "") const {
       using namespace serializer;
-      Serializer key(strlen(ns) + strlen(sub));
+      Serializer key(strlen(ns) + sublen);
       Serializer value(sizeof(int) + sizeof(size_t));
-      key << PtrCon(ns, strlen(ns)) << PtrCon(sub, strlen(sub));
+      key << PtrCon(ns, strlen(ns)) << PtrCon(sub, sublen);
       value << docid << pos;
-      tcm.append(key.data(), key.size(), value.data(), value.size());
+      bloom.add(key.data(), key.size());
+      if(buffer.enabled())
+        buffer.append(key.data(), key.size(), value.data(), value.size());
+      else
+        tcm.append(key.data(), key.size(), value.data(), value.size());
+    }
+
+    PostingList read_index(const char *sub, const char *ns = "") const {
+      return read_index(sub, strlen(sub), ns);
     }
 
-    IdxType read_index(const char *sub, const char *ns = "") const {
+    // The list is allocated with alloc, e.g. from the arena of a query.
+    PostingList read_index(const char *sub, size_t sublen, const char *ns = "",
+                           const PostingAllocator &alloc
+                           = PostingAllocator()) const {
       using namespace serializer;
-      IdxType m;
-      void *data;
-      int n;
-      Serializer key(strlen(ns) + strlen(sub));
-      key << PtrCon(ns, strlen(ns)) << PtrCon(sub, strlen(sub));
-      tcm.read(key.data(), key.size(), &data, &n);
-      if(data == NULL) return m;
-
-      DeSerializer des(data, n);
-      while(!des.eof()){
-        int docid; size_t pos;
-        des >> docid >> pos;
-        m.insert(std::make_pair(docid, pos));
+      Serializer key(strlen(ns) + sublen);
+      key << PtrCon(ns, strlen(ns)) << PtrCon(sub, sublen);
+      if(!bloom.maybe_contains(key.data(), key.size()))
+        return PostingList(alloc);
+      return ReadPostings(key.data(), key.size(), alloc);
+    }
+
+    // Number of postings of the bigram, without reading them.
+    size_t count_index(const char *sub, const char *ns = "") const {
+      return count_index(sub, strlen(sub), ns);
+    }
+
+    size_t count_index(const char *sub, size_t sublen,
+                       const char *ns = "") const {
+      using namespace serializer;
+      Serializer key(strlen(ns) + sublen);
+      key << PtrCon(ns, strlen(ns)) << PtrCon(sub, sublen);
+      if(!bloom.maybe_contains(key.data(), key.size())) return 0;
+      int n = tcm.vsiz(key.data(), key.size());
+      size_t bytes = (n < 0) ? 0 : n;
+      if(buffer.enabled()) bytes += buffer.size(key.data(), key.size());
+      return bytes / (sizeof(int) + sizeof(size_t));
+    }
+
+    // Raw key access for offline tools which rewrite the whole index
+    // (see nanase_reorder.cc). Keys are passed as stored, namespace
+    // included.
+    bool is_index_key(const void *key, int ksiz) const {
+      size_t seqlen = strlen(constants::SEQUENCE_KEY_NAME);
+      if(static_cast<size_t>(ksiz) == seqlen
+         && memcmp(key, constants::SEQUENCE_KEY_NAME, seqlen) == 0)
+        return false;
+      if(static_cast<size_t>(ksiz) == sizeof(unsigned char) * 2 + sizeof(int)
+         && memcmp(key, constants::DOCINFO_PREFIX, 2) == 0)
+        return false;
+      if(static_cast<size_t>(ksiz) == TEXT_KEY_SIZE
+         && memcmp(key, TextPrefix(), 2) == 0)
+        return false;
+      if(static_cast<size_t>(ksiz) == strlen(AbortedKey())
+         && memcmp(key, AbortedKey(), ksiz) == 0)
+        return false;
+      return true;
+    }
+
+    std::vector<std::string> index_keys() const {
+      std::vector<std::string> keys;
+      tcm.iterinit();
+      void *key;
+      int ksiz;
+      while((key = tcm.iternext(&ksiz)) != NULL){
+        if(is_index_key(key, ksiz))
+          keys.push_back(std::string(reinterpret_cast<char *>(key), ksiz));
+        free(key);
       }
-      free(data);
+      return keys;
+    }
 
-      return m;
+    // The n index keys with the largest posting lists, largest first.
+    // This scans every record, setting *cancelled stops it half way.
+    std::vector<std::string>
+    largest_index_keys(size_t n, const volatile bool *cancelled = NULL) const {
+      typedef std::pair<int, std::string> SizedKey;
+      std::vector<SizedKey> heap;
+      tcm.iterinit();
+      void *key;
+      int ksiz;
+      while(n > 0 && !(cancelled != NULL && *cancelled)
+            && (key = tcm.iternext(&ksiz)) != NULL){
+        if(is_index_key(key, ksiz)){
+          int size = tcm.vsiz(key, ksiz);
+          if(heap.size() < n || size > heap.front().first){
+            heap.push_back(SizedKey(size, std::string(
+                                      reinterpret_cast<char *>(key), ksiz)));
+            std::push_heap(heap.begin(), heap.end(),
+                           std::greater<SizedKey>());
+            if(heap.size() > n){
+              std::pop_heap(heap.begin(), heap.end(),
+                            std::greater<SizedKey>());
+              heap.pop_back();
+            }
+          }
+        }
+        free(key);
+      }
+      std::sort_heap(heap.begin(), heap.end(), std::greater<SizedKey>());
+      std::vector<std::string> keys;
+      for(size_t i = 0; i < heap.size(); i++) keys.push_back(heap[i].second);
+      return keys;
+    }
+
+    // Keys of the largest posting lists are saved next to the database,
+    // so that they are not searched for by a full scan at every start.
+    // They are only a hint: a stale list warms the wrong lists, nothing
+    // worse. The list is recomputed once the index has doubled.
+    bool load_hot_keys(std::vector<std::string> &keys) const {
+      std::ifstream in(hot_path.c_str(), std::ios::binary);
+      char magic[8];
+      int32_t stamp;
+      uint32_t n;
+      if(!in.read(magic, sizeof(magic)) || memcmp(magic, "NNSHOTKS", 8) != 0
+         || !in.read(reinterpret_cast<char *>(&stamp), sizeof(stamp))
+         || !in.read(reinterpret_cast<char *>(&n), sizeof(n))
+         || static_cast<int64_t>(stamp) * 2 < get_current_docid())
+        return false;
+      std::vector<std::string> loaded(n);
+      for(uint32_t i = 0; i < n; i++){
+        uint32_t len;
+        // Keys are short, a larger length means a broken file.
+        if(!in.read(reinterpret_cast<char *>(&len), sizeof(len))
+           || len > 1024)
+          return false;
+        loaded[i].resize(len);
+        if(len > 0 && !in.read(&loaded[i][0], len)) return false;
+      }
+      keys.swap(loaded);
+      return true;
+    }
+
+    // Written to a temporary file and renamed, like the Bloom filter.
+    bool save_hot_keys(const std::vector<std::string> &keys) const {
+      std::string tmp = hot_path + ".tmp";
+      bool ok;
+      {
+        std::ofstream out(tmp.c_str(), std::ios::binary);
+        int32_t stamp = get_current_docid();
+        uint32_t n = keys.size();
+        out.write("NNSHOTKS", 8);
+        out.write(reinterpret_cast<const char *>(&stamp), sizeof(stamp));
+        out.write(reinterpret_cast<const char *>(&n), sizeof(n));
+        for(size_t i = 0; i < keys.size(); i++){
+          uint32_t len = keys[i].size();
+          out.write(reinterpret_cast<const char *>(&len), sizeof(len));
+          out.write(keys[i].data(), len);
+        }
+        out.close();
+        ok = !out.fail();
+      }
+      if(ok) ok = rename(tmp.c_str(), hot_path.c_str()) == 0;
+      if(!ok) remove(tmp.c_str());
+      return ok;
+    }
+
+    PostingList read_index_raw(const std::string &key) const {
+      return ReadPostings(key.data(), key.size(), PostingAllocator());
+    }
+
+    // Replaces the whole posting list of the key.
+    void write_index_raw(const std::string &key, const PostingList &m) const {
+      using namespace serializer;
+      Serializer value(m.size() * (sizeof(int) + sizeof(size_t)));
+      for(size_t i = 0; i < m.size(); i++){
+        value << posting_docid(m[i]) << posting_pos(m[i]);
+      }
+      bloom.add(key.data(), key.size());
+      tcm.write(key.data(), key.size(), value.data(), value.size());
     }
 
     void write_docinfo(const DocInfo &docinfo) const {
@@ -108,15 +416,45 @@ namespace nanase {
       Serializer key(sizeof(unsigned char) * 2 + sizeof(int));
       key << PtrCon(constants::DOCINFO_PREFIX, 2) << docinfo.docid;
 
-      void *data;
-      int data_size;
-      tcm.read(key.data(), key.size(), &data, &data_size);
-      if(data == NULL) return false;
-      docinfo.deserialize(reinterpret_cast<unsigned char *>(data), data_size);
-      free(data);
+      ReadBuffer &buf = ReadBuffer::for_thread();
+      int data_size = tcm.read(key.data(), key.size(), buf);
+      if(data_size < 0) return false;
+      docinfo.deserialize(reinterpret_cast<unsigned char *>(buf.data()),
+                          data_size);
+      buf.shrink();
       return true;
     }
 
+    // Texts of the documents, for snippets. A text is stored in blocks
+    // of TEXT_BLOCK_CHARS characters, each compressed on its own, so that
+    // a part of it can be read without inflating the whole.
+    static const size_t TEXT_BLOCK_CHARS = 1024;
+
+    // Whether indexers store the texts they index.
+    void set_store_text(bool store){
+      store_text = store;
+    }
+
+    bool stores_text() const {
+      return store_text;
+    }
+
+    void write_text_block(int docid, int block,
+                          const char *text, size_t len) const {
+      using namespace serializer;
+      Serializer key(TEXT_KEY_SIZE);
+      key << PtrCon(TextPrefix(), 2) << docid << block;
+      tcm.write_deflated(key.data(), key.size(), text, len);
+    }
+
+    // Returns false if the block is not stored.
+    bool read_text_block(int docid, int block, std::string &text) const {
+      using namespace serializer;
+      Serializer key(TEXT_KEY_SIZE);
+      key << PtrCon(TextPrefix(), 2) << docid << block;
+      return tcm.read_inflated(key.data(), key.size(), text);
+    }
+
     int get_new_docid() const {
       return tcm.inc(constants::SEQUENCE_KEY_NAME,
                      strlen(constants::SEQUENCE_KEY_NAME), 1);
@@ -126,6 +464,111 @@ namespace nanase {
       return tcm.inc(constants::SEQUENCE_KEY_NAME,
                      strlen(constants::SEQUENCE_KEY_NAME), 0);
     }
+
+    // Allocates a docid for a new document, which stays invisible to
+    // snapshots until end_document is called for it (and for every
+    // document begun before it).
+    int begin_document() const {
+      pthread_mutex_lock(&docid_mutex);
+      int docid;
+      try {
+        docid = get_new_docid();
+      }catch(...){
+        pthread_mutex_unlock(&docid_mutex);
+        throw;
+      }
+      inflight.insert(docid);
+      if(docid > last_docid) last_docid = docid;
+      pthread_mutex_unlock(&docid_mutex);
+      return docid;
+    }
+
+    // Also called, with completed false, for a document which failed half
+    // way. It has no DocInfo, and its postings are dropped by searchers.
+    void end_document(int docid, bool completed = true) const throw() {
+      pthread_mutex_lock(&docid_mutex);
+      if(!completed){
+        aborted.insert(docid);
+        // If it cannot be recorded, the document still has no DocInfo
+        // and is only left out of search results.
+        try {
+          tcm.append(AbortedKey(), strlen(AbortedKey()), &docid, sizeof(int));
+        }catch(...){
+        }
+      }
+      inflight.erase(docid);
+      int c = inflight.empty() ? last_docid : *inflight.begin() - 1;
+      __sync_lock_test_and_set(&committed, c);
+      pthread_mutex_unlock(&docid_mutex);
+    }
+
+    // Documents up to the generation which failed half way, in order.
+    std::vector<int> aborted_docids(int generation) const {
+      pthread_mutex_lock(&docid_mutex);
+      std::vector<int> docids(aborted.begin(),
+                              aborted.upper_bound(generation));
+      pthread_mutex_unlock(&docid_mutex);
+      return docids;
+    }
+
+    // The generation a snapshot is pinned to. Documents with larger
+    // docids are ignored by the snapshot.
+    int committed_docid() const {
+      return __sync_fetch_and_add(&committed, 0);
+    }
+
+    // Also commits every document up to docid when none is being
+    // indexed, so that snapshots taken afterwards see them.
+    void set_current_docid(int docid) const {
+      pthread_mutex_lock(&docid_mutex);
+      try {
+        tcm.inc(constants::SEQUENCE_KEY_NAME,
+                strlen(constants::SEQUENCE_KEY_NAME),
+                docid - get_current_docid());
+      }catch(...){
+        pthread_mutex_unlock(&docid_mutex);
+        throw;
+      }
+      if(inflight.empty()){
+        last_docid = docid;
+        __sync_lock_test_and_set(&committed, docid);
+      }
+      pthread_mutex_unlock(&docid_mutex);
+    }
+
+    uint64_t file_size() const {
+      return tcm.fsiz();
+    }
+
+    // Brings the header and the bucket array of the database into the
+    // page cache, so that the first lookups do not fault on them. The
+    // array is assumed to have 64bit elements, which covers both bucket
+    // widths of Tokyo Cabinet. Setting *cancelled stops it half way.
+    void prefetch_buckets(const volatile bool *cancelled = NULL) const {
+      const off_t HEADER_SIZE = 256;
+      off_t size = HEADER_SIZE + static_cast<off_t>(tcm.bnum()) * sizeof(uint64_t);
+      int fd = ::open(tcm.path(), O_RDONLY);
+      if(fd < 0) return;
+      posix_fadvise(fd, 0, size, POSIX_FADV_WILLNEED);
+      // The advice is asynchronous, reading makes sure the pages are in
+      // when this returns.
+      std::vector<char> buf(1 << 20);
+      for(off_t off = 0; off < size && !(cancelled != NULL && *cancelled); ){
+        size_t len = std::min(static_cast<off_t>(buf.size()), size - off);
+        ssize_t n = pread(fd, &buf[0], len, off);
+        if(n <= 0) break;
+        off += n;
+      }
+      ::close(fd);
+    }
+
+    // Reads the record of the key into the buffer of the thread, to
+    // bring it into the page cache.
+    void prefetch_index_raw(const std::string &key) const {
+      ReadBuffer &buf = ReadBuffer::for_thread();
+      tcm.read(key.data(), key.size(), buf);
+      buf.shrink();
+    }
   };
 };
 
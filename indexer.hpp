@@ -25,34 +25,197 @@
 #include "indexdb.hpp"
 #include "docinfo.hpp"
 #include <vector>
+#include <string>
+#include <istream>
+#include <stdexcept>
 #include <cstring>
+#include <cerrno>
+#include <stdint.h>
+#include <limits>
+#include <unistd.h>
 
 namespace nanase {
   class Indexer {
     IndexDB &idxdb;
+    size_t read_buffer_size;
+
+    static const size_t READ_BUFFER_SIZE = 64 * 1024;
+
+    // Turns the text of a document, given in chunks of any size, into
+    // bigrams and writes them to the index. A bigram needs the character
+    // following it and a multibyte character may be split between two
+    // chunks, so the last character (and the incomplete one, if any) is
+    // carried over to the next chunk. Memory use does not depend on the
+    // document size. If the index stores texts, the characters are also
+    // gathered into blocks of IndexDB::TEXT_BLOCK_CHARS, written as they
+    // fill up.
+    class BigramWriter {
+      static const size_t MAX_CHAR_LEN = 6;
+
+      const IndexDB &idxdb;
+      int docid;
+      size_t pos;
+      char prev[MAX_CHAR_LEN];
+      size_t prevlen;
+      char partial[MAX_CHAR_LEN];
+      size_t partiallen;
+      size_t partialneed;
+      std::string block;
+      size_t blockchars;
+      int blocknum;
+
+      void WriteBlock(){
+        idxdb.write_text_block(docid, blocknum++, block.data(), block.size());
+        block.clear();
+        blockchars = 0;
+      }
+
+      // Postings keep 32 bits of the position (see make_posting), and
+      // the searcher looks for posting+1 and posting+2, so the position
+      // must stay 2 below the maximum or the addition carries into the
+      // docid and gives a false adjacency with the next document.
+      void Append(const char *sub, size_t len){
+        if(pos > std::numeric_limits<uint32_t>::max() - 2)
+          throw std::length_error("document has too many characters");
+        idxdb.append_index(sub, len, docid, pos, "");
+        pos++;
+      }
+
+      void Emit(const char *c, size_t clen){
+        if(idxdb.stores_text()){
+          block.append(c, clen);
+          if(++blockchars == IndexDB::TEXT_BLOCK_CHARS) WriteBlock();
+        }
+        if(prevlen > 0){
+          char sub[MAX_CHAR_LEN * 2];
+          memcpy(sub, prev, prevlen);
+          memcpy(sub + prevlen, c, clen);
+          Append(sub, prevlen + clen);
+        }
+        memcpy(prev, c, clen);
+        prevlen = clen;
+      }
+
+      BigramWriter();
+      BigramWriter(const BigramWriter &);
+      BigramWriter &operator=(const BigramWriter &);
+
+    public:
+      BigramWriter(const IndexDB &_idxdb, int _docid)
+        : idxdb(_idxdb), docid(_docid), pos(0), prevlen(0),
+          partiallen(0), partialneed(0), blockchars(0), blocknum(0) {}
+
+      void write(const char *buf, size_t len){
+        size_t i = 0;
+        while(partiallen > 0 && i < len){
+          partial[partiallen++] = buf[i++];
+          if(partiallen == partialneed){
+            Emit(partial, partiallen);
+            partiallen = 0;
+          }
+        }
+        while(i < len){
+          size_t l = utf8textcharlen(buf[i]);
+          if(i + l > len){
+            partiallen = len - i;
+            partialneed = l;
+            memcpy(partial, buf + i, partiallen);
+            break;
+          }
+          Emit(buf + i, l);
+          i += l;
+        }
+      }
+
+      // Returns the number of characters written.
+      size_t finish(){
+        // A character cut off by the end of the text is indexed as is.
+        if(partiallen > 0){
+          Emit(partial, partiallen);
+          partiallen = 0;
+        }
+        if(prevlen > 0){
+          Append(prev, prevlen);
+          prevlen = 0;
+        }
+        if(blockchars > 0) WriteBlock();
+        return pos;
+      }
+    };
+
+    // Ends the document however add leaves, as aborted unless it was
+    // completed.
+    class DocumentGuard {
+      const IndexDB &idxdb;
+      int docid;
+      bool completed;
+      DocumentGuard(const DocumentGuard &);
+      DocumentGuard &operator=(const DocumentGuard &);
+    public:
+      DocumentGuard(const IndexDB &_idxdb, int _docid)
+        : idxdb(_idxdb), docid(_docid), completed(false) {}
+      ~DocumentGuard(){ idxdb.end_document(docid, completed); }
+      void complete(){ completed = true; }
+    };
+
+    void Finish(const char *url, const char *title, int docid,
+                BigramWriter &writer) const {
+      DocInfo docinfo(docid, url, title);
+      docinfo.wordnum = writer.finish();
+      idxdb.write_docinfo(docinfo);
+    }
 
     Indexer();
   public:
     void add(const char *url, const char *title, const char *text) const {
-      int docid = idxdb.get_new_docid();
-      DocInfo docinfo(docid, url, title);
+      add(url, title, text, strlen(text));
+    }
 
-      const char *p = text;
-      size_t pos = 0;
-      while(*p != '\0'){
-        const char *sub = utf8substr(p, 2);
-        idxdb.append_index(sub, docid, pos, "");
-        delete[] sub;
-        p = utf8nextchar(p);
-        pos++;
+    // The text may contain NUL characters, e.g. a mmapped file.
+    void add(const char *url, const char *title,
+             const char *text, size_t len) const {
+      int docid = idxdb.begin_document();
+      DocumentGuard guard(idxdb, docid);
+      BigramWriter writer(idxdb, docid);
+      writer.write(text, len);
+      Finish(url, title, docid, writer);
+      guard.complete();
+    }
+
+    void add(const char *url, const char *title, std::istream &in) const {
+      int docid = idxdb.begin_document();
+      DocumentGuard guard(idxdb, docid);
+      BigramWriter writer(idxdb, docid);
+      std::vector<char> buf(read_buffer_size);
+      while(in.read(&buf[0], buf.size()) || in.gcount() > 0){
+        writer.write(&buf[0], in.gcount());
       }
+      if(in.bad()) throw std::runtime_error("failed to read the text");
+      Finish(url, title, docid, writer);
+      guard.complete();
+    }
 
-      docinfo.wordnum = pos;
-      idxdb.write_docinfo(docinfo);
+    // Reads the text from fd until EOF. fd is not closed.
+    void add(const char *url, const char *title, int fd) const {
+      int docid = idxdb.begin_document();
+      DocumentGuard guard(idxdb, docid);
+      BigramWriter writer(idxdb, docid);
+      std::vector<char> buf(read_buffer_size);
+      ssize_t n;
+      while((n = read(fd, &buf[0], buf.size())) != 0){
+        if(n < 0){
+          if(errno == EINTR) continue;
+          throw std::runtime_error(strerror(errno));
+        }
+        writer.write(&buf[0], n);
+      }
+      Finish(url, title, docid, writer);
+      guard.complete();
     }
 
-    Indexer(IndexDB &_idxdb)
-      : idxdb(_idxdb) {
+    // Streamed texts are read read_buffer_size bytes at a time.
+    Indexer(IndexDB &_idxdb, size_t _read_buffer_size = READ_BUFFER_SIZE)
+      : idxdb(_idxdb), read_buffer_size(_read_buffer_size) {
     }
   };
 }
@@ -0,0 +1,80 @@
+#include "indexer.hpp"
+#include <iostream>
+#include <sstream>
+#include <cstdio>
+using namespace std;
+using namespace nanase;
+
+// Postings of each document, as (key, position), and its character count.
+typedef vector<pair<string, int> > Postings;
+
+Postings DocumentPostings(IndexDB &idxdb, int docid){
+  Postings postings;
+  vector<string> keys = idxdb.index_keys();
+  for(size_t k = 0; k < keys.size(); k++){
+    PostingList m = idxdb.read_index_raw(keys[k]);
+    for(size_t i = 0; i < m.size(); i++){
+      if(posting_docid(m[i]) == docid)
+        postings.push_back(make_pair(keys[k], posting_pos(m[i])));
+    }
+  }
+  sort(postings.begin(), postings.end());
+  return postings;
+}
+
+size_t WordNum(IndexDB &idxdb, int docid){
+  DocInfo docinfo(docid);
+  idxdb.read_docinfo(docinfo);
+  return docinfo.wordnum;
+}
+
+// Streaming a text in chunks of any size must index it as a whole:
+// multibyte characters split between chunks, NUL characters and the
+// trailing unigram included.
+int main(int argc, char *argv[])
+{
+  const char *path = "indexer_test.idx";
+  remove(path);
+  remove("indexer_test.idx.bloom");
+
+  const string texts[] = {
+    "a",
+    "\xe3\x81\x82",
+    "abc\xe3\x81\x82\xe3\x81\x84z",
+    string("x\0y\xe6\x97\xa5\0", 6),
+    "\xf0\x9f\x98\x80\xe6\x97\xa5\xe6\x9c\xac\xe8\xaa\x9e" "ab\xc3\xa9",
+  };
+  const size_t ntexts = sizeof(texts) / sizeof(texts[0]);
+
+  int failures = 0;
+  try {
+    IndexDB idxdb(path);
+    for(size_t t = 0; t < ntexts; t++){
+      Indexer whole(idxdb);
+      whole.add("u", "t", texts[t].data(), texts[t].size());
+      int expected = idxdb.get_current_docid();
+      Postings postings = DocumentPostings(idxdb, expected);
+
+      for(size_t size = 1; size <= 7; size++){
+        Indexer streamed(idxdb, size);
+        istringstream in(texts[t]);
+        streamed.add("u", "t", in);
+        int docid = idxdb.get_current_docid();
+        if(DocumentPostings(idxdb, docid) != postings
+           || WordNum(idxdb, docid) != WordNum(idxdb, expected)){
+          cout << "NG: text " << t << ", buffer size " << size << endl;
+          failures++;
+        }
+      }
+    }
+    idxdb.close();
+  }catch(exception &e){
+    cout << e.what() << endl;
+    failures++;
+  }
+
+  remove(path);
+  remove("indexer_test.idx.bloom");
+  if(failures == 0) cout << "ok" << endl;
+  return failures == 0 ? 0 : 1;
+}
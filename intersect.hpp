@@ -0,0 +1,270 @@
+// Copyright (C) 2010 Masahiko Higashiyama
+//
+// Permission is hereby granted, free of charge, to any person obtaining a
+// copy of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#ifndef INTERSECT_HPP
+#define INTERSECT_HPP
+
+#include <stdint.h>
+#include <cstddef>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define NANASE_X86_SIMD
+#include <immintrin.h>
+#endif
+
+// Sorted integer intersection kernels.
+//
+// All kernels take two strictly increasing arrays a and b and write to out
+// every b[j] such that b[j] + delta is found in a. With delta == 0 this is
+// a plain intersection (used for docid sets), with delta == distance it is
+// the adjacency check of Searcher::CheckConnection on packed postings.
+// out must have room for min(na, nb) elements and must not alias a or b.
+namespace nanase {
+
+  template <typename T>
+  size_t intersect_scalar(const T *a, size_t na, const T *b, size_t nb,
+                          T delta, T *out){
+    size_t i = 0, j = 0, k = 0;
+    while(i < na && j < nb){
+      T bv = b[j] + delta;
+      if(a[i] < bv){
+        i++;
+      }else if(bv < a[i]){
+        j++;
+      }else{
+        out[k++] = b[j];
+        i++; j++;
+      }
+    }
+    return k;
+  }
+
+  // When one list is much shorter than the other, a linear merge wastes
+  // most of its time walking the long list. Walk the short one and
+  // gallop in the long one instead.
+  template <typename T>
+  size_t intersect_gallop(const T *a, size_t na, const T *b, size_t nb,
+                          T delta, T *out){
+    size_t k = 0;
+    if(nb <= na){
+      size_t lo = 0;
+      for(size_t j = 0; j < nb && lo < na; j++){
+        T target = b[j] + delta;
+        size_t step = 1, hi = lo;
+        while(hi < na && a[hi] < target){
+          lo = hi + 1;
+          hi += step;
+          step <<= 1;
+        }
+        if(hi > na) hi = na;
+        while(lo < hi){
+          size_t mid = lo + (hi - lo) / 2;
+          if(a[mid] < target) lo = mid + 1;
+          else hi = mid;
+        }
+        if(lo < na && a[lo] == target) out[k++] = b[j];
+      }
+    }else{
+      size_t lo = 0;
+      for(size_t i = 0; i < na && lo < nb; i++){
+        if(a[i] < delta) continue;
+        T target = a[i] - delta;
+        size_t step = 1, hi = lo;
+        while(hi < nb && b[hi] < target){
+          lo = hi + 1;
+          hi += step;
+          step <<= 1;
+        }
+        if(hi > nb) hi = nb;
+        while(lo < hi){
+          size_t mid = lo + (hi - lo) / 2;
+          if(b[mid] < target) lo = mid + 1;
+          else hi = mid;
+        }
+        if(lo < nb && b[lo] == target) out[k++] = b[lo];
+      }
+    }
+    return k;
+  }
+
+#ifdef NANASE_X86_SIMD
+  // Block kernels: compare a block of b against every rotation of a block
+  // of a, so one round finds all matches between the two blocks. Then
+  // advance the block with the smaller maximum (or both if equal) and
+  // finish the remainder with the scalar merge.
+
+  __attribute__((target("sse4.2")))
+  inline size_t intersect_sse42(const uint32_t *a, size_t na,
+                                const uint32_t *b, size_t nb,
+                                uint32_t delta, uint32_t *out){
+    size_t i = 0, j = 0, k = 0;
+    const __m128i d = _mm_set1_epi32(static_cast<int>(delta));
+    while(i + 4 <= na && j + 4 <= nb){
+      __m128i va = _mm_loadu_si128(reinterpret_cast<const __m128i *>(a + i));
+      __m128i vb = _mm_add_epi32(
+        _mm_loadu_si128(reinterpret_cast<const __m128i *>(b + j)), d);
+      __m128i m = _mm_cmpeq_epi32(vb, va);
+      m = _mm_or_si128(m, _mm_cmpeq_epi32(
+                         vb, _mm_shuffle_epi32(va, _MM_SHUFFLE(0, 3, 2, 1))));
+      m = _mm_or_si128(m, _mm_cmpeq_epi32(
+                         vb, _mm_shuffle_epi32(va, _MM_SHUFFLE(1, 0, 3, 2))));
+      m = _mm_or_si128(m, _mm_cmpeq_epi32(
+                         vb, _mm_shuffle_epi32(va, _MM_SHUFFLE(2, 1, 0, 3))));
+      int mask = _mm_movemask_ps(_mm_castsi128_ps(m));
+      while(mask){
+        int l = __builtin_ctz(mask);
+        out[k++] = b[j + l];
+        mask &= mask - 1;
+      }
+      uint32_t amax = a[i + 3], bmax = b[j + 3] + delta;
+      if(amax <= bmax) i += 4;
+      if(bmax <= amax) j += 4;
+    }
+    return k + intersect_scalar(a + i, na - i, b + j, nb - j, delta, out + k);
+  }
+
+  __attribute__((target("sse4.2")))
+  inline size_t intersect_sse42(const uint64_t *a, size_t na,
+                                const uint64_t *b, size_t nb,
+                                uint64_t delta, uint64_t *out){
+    size_t i = 0, j = 0, k = 0;
+    const __m128i d = _mm_set1_epi64x(static_cast<long long>(delta));
+    while(i + 2 <= na && j + 2 <= nb){
+      __m128i va = _mm_loadu_si128(reinterpret_cast<const __m128i *>(a + i));
+      __m128i vb = _mm_add_epi64(
+        _mm_loadu_si128(reinterpret_cast<const __m128i *>(b + j)), d);
+      __m128i m = _mm_cmpeq_epi64(vb, va);
+      m = _mm_or_si128(m, _mm_cmpeq_epi64(
+                         vb, _mm_shuffle_epi32(va, _MM_SHUFFLE(1, 0, 3, 2))));
+      int mask = _mm_movemask_pd(_mm_castsi128_pd(m));
+      while(mask){
+        int l = __builtin_ctz(mask);
+        out[k++] = b[j + l];
+        mask &= mask - 1;
+      }
+      uint64_t amax = a[i + 1], bmax = b[j + 1] + delta;
+      if(amax <= bmax) i += 2;
+      if(bmax <= amax) j += 2;
+    }
+    return k + intersect_scalar(a + i, na - i, b + j, nb - j, delta, out + k);
+  }
+
+  __attribute__((target("avx2")))
+  inline size_t intersect_avx2(const uint32_t *a, size_t na,
+                               const uint32_t *b, size_t nb,
+                               uint32_t delta, uint32_t *out){
+    size_t i = 0, j = 0, k = 0;
+    const __m256i d = _mm256_set1_epi32(static_cast<int>(delta));
+    const __m256i rot = _mm256_setr_epi32(1, 2, 3, 4, 5, 6, 7, 0);
+    while(i + 8 <= na && j + 8 <= nb){
+      __m256i va = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(a + i));
+      __m256i vb = _mm256_add_epi32(
+        _mm256_loadu_si256(reinterpret_cast<const __m256i *>(b + j)), d);
+      __m256i m = _mm256_cmpeq_epi32(vb, va);
+      for(int r = 1; r < 8; r++){
+        va = _mm256_permutevar8x32_epi32(va, rot);
+        m = _mm256_or_si256(m, _mm256_cmpeq_epi32(vb, va));
+      }
+      int mask = _mm256_movemask_ps(_mm256_castsi256_ps(m));
+      while(mask){
+        int l = __builtin_ctz(mask);
+        out[k++] = b[j + l];
+        mask &= mask - 1;
+      }
+      uint32_t amax = a[i + 7], bmax = b[j + 7] + delta;
+      if(amax <= bmax) i += 8;
+      if(bmax <= amax) j += 8;
+    }
+    return k + intersect_scalar(a + i, na - i, b + j, nb - j, delta, out + k);
+  }
+
+  __attribute__((target("avx2")))
+  inline size_t intersect_avx2(const uint64_t *a, size_t na,
+                               const uint64_t *b, size_t nb,
+                               uint64_t delta, uint64_t *out){
+    size_t i = 0, j = 0, k = 0;
+    const __m256i d = _mm256_set1_epi64x(static_cast<long long>(delta));
+    while(i + 4 <= na && j + 4 <= nb){
+      __m256i va = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(a + i));
+      __m256i vb = _mm256_add_epi64(
+        _mm256_loadu_si256(reinterpret_cast<const __m256i *>(b + j)), d);
+      __m256i m = _mm256_cmpeq_epi64(vb, va);
+      m = _mm256_or_si256(m, _mm256_cmpeq_epi64(
+                            vb, _mm256_permute4x64_epi64(va, _MM_SHUFFLE(0, 3, 2, 1))));
+      m = _mm256_or_si256(m, _mm256_cmpeq_epi64(
+                            vb, _mm256_permute4x64_epi64(va, _MM_SHUFFLE(1, 0, 3, 2))));
+      m = _mm256_or_si256(m, _mm256_cmpeq_epi64(
+                            vb, _mm256_permute4x64_epi64(va, _MM_SHUFFLE(2, 1, 0, 3))));
+      int mask = _mm256_movemask_pd(_mm256_castsi256_pd(m));
+      while(mask){
+        int l = __builtin_ctz(mask);
+        out[k++] = b[j + l];
+        mask &= mask - 1;
+      }
+      uint64_t amax = a[i + 3], bmax = b[j + 3] + delta;
+      if(amax <= bmax) i += 4;
+      if(bmax <= amax) j += 4;
+    }
+    return k + intersect_scalar(a + i, na - i, b + j, nb - j, delta, out + k);
+  }
+#endif /* NANASE_X86_SIMD */
+
+  enum SimdLevel {
+    SIMD_NONE,
+    SIMD_SSE42,
+    SIMD_AVX2
+  };
+
+  inline SimdLevel simd_level(){
+#ifdef NANASE_X86_SIMD
+    static const SimdLevel level =
+      __builtin_cpu_supports("avx2") ? SIMD_AVX2 :
+      __builtin_cpu_supports("sse4.2") ? SIMD_SSE42 : SIMD_NONE;
+    return level;
+#else
+    return SIMD_NONE;
+#endif
+  }
+
+  // Lists whose sizes differ more than this ratio are galloped.
+  const size_t INTERSECT_GALLOP_RATIO = 32;
+
+  template <typename T>
+  size_t intersect(const T *a, size_t na, const T *b, size_t nb,
+                   T delta, T *out){
+    if(na == 0 || nb == 0) return 0;
+    if(na / INTERSECT_GALLOP_RATIO > nb || nb / INTERSECT_GALLOP_RATIO > na)
+      return intersect_gallop(a, na, b, nb, delta, out);
+#ifdef NANASE_X86_SIMD
+    switch(simd_level()){
+    case SIMD_AVX2:
+      return intersect_avx2(a, na, b, nb, delta, out);
+    case SIMD_SSE42:
+      return intersect_sse42(a, na, b, nb, delta, out);
+    default:
+      break;
+    }
+#endif
+    return intersect_scalar(a, na, b, nb, delta, out);
+  }
+};
+
+#endif /* INTERSECT_HPP */
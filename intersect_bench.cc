@@ -0,0 +1,84 @@
+#include "intersect.hpp"
+#include <cstdio>
+#include <cstdlib>
+#include <cassert>
+#include <ctime>
+#include <vector>
+#include <algorithm>
+using namespace std;
+using namespace nanase;
+
+template <typename T>
+vector<T> RandomSorted(size_t n, T universe){
+  vector<T> v;
+  v.reserve(n);
+  while(v.size() < n){
+    T x = static_cast<T>((static_cast<uint64_t>(rand()) << 31 | rand())
+                         % universe);
+    v.push_back(x);
+  }
+  sort(v.begin(), v.end());
+  v.erase(unique(v.begin(), v.end()), v.end());
+  return v;
+}
+
+double Now(){
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+template <typename T, typename Kernel>
+double Bench(Kernel kernel, const vector<T> &a, const vector<T> &b,
+             T delta, vector<T> &out, size_t *n){
+  const int repeat = 50;
+  double start = Now();
+  for(int r = 0; r < repeat; r++)
+    *n = kernel(&a[0], a.size(), &b[0], b.size(), delta, &out[0]);
+  return (Now() - start) / repeat * 1e6;
+}
+
+template <typename T>
+void Run(const char *name, T delta){
+  const size_t large = 1 << 20;
+  const size_t ratios[] = {1, 4, 16, 64, 256, 1024};
+  printf("%s (delta=%lu)\n", name, static_cast<unsigned long>(delta));
+  printf("%8s %10s %10s %10s %10s %10s\n",
+         "ratio", "matches", "scalar", "gallop", "sse4.2", "avx2");
+  for(size_t r = 0; r < sizeof(ratios) / sizeof(ratios[0]); r++){
+    vector<T> a = RandomSorted<T>(large, static_cast<T>(large * 4));
+    vector<T> b = RandomSorted<T>(large / ratios[r], static_cast<T>(large * 4));
+    vector<T> out(min(a.size(), b.size())), expect;
+    size_t n, m;
+    double scalar = Bench(intersect_scalar<T>, a, b, delta, out, &n);
+    expect.assign(out.begin(), out.begin() + n);
+    double gallop = Bench(intersect_gallop<T>, a, b, delta, out, &m);
+    assert(m == n && equal(expect.begin(), expect.end(), out.begin()));
+    double sse = -1, avx = -1;
+#ifdef NANASE_X86_SIMD
+    size_t (*sse_kernel)(const T *, size_t, const T *, size_t, T, T *)
+      = intersect_sse42;
+    size_t (*avx_kernel)(const T *, size_t, const T *, size_t, T, T *)
+      = intersect_avx2;
+    if(simd_level() >= SIMD_SSE42){
+      sse = Bench(sse_kernel, a, b, delta, out, &m);
+      assert(m == n && equal(expect.begin(), expect.end(), out.begin()));
+    }
+    if(simd_level() >= SIMD_AVX2){
+      avx = Bench(avx_kernel, a, b, delta, out, &m);
+      assert(m == n && equal(expect.begin(), expect.end(), out.begin()));
+    }
+#endif
+    printf("%6lu:1 %10lu %8.1fus %8.1fus %8.1fus %8.1fus\n",
+           static_cast<unsigned long>(ratios[r]), static_cast<unsigned long>(n),
+           scalar, gallop, sse, avx);
+  }
+}
+
+int main(int argc, char *argv[])
+{
+  srand(12345);
+  Run<uint32_t>("uint32 docid intersection", 0);
+  Run<uint64_t>("uint64 posting adjacency", 1);
+  return 0;
+}
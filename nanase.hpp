@@ -24,28 +24,72 @@
 #include "searcher.hpp"
 #include "indexer.hpp"
 #include "indexdb.hpp"
+#include "threadpool.hpp"
+#include "warmer.hpp"
 
 namespace nanase {
   class Nanase {
     IndexDB idxdb;
+    ThreadPool *pool;
+    Warmer *warmer;
 
     Nanase(const Nanase&);
     Nanase& operator=(const Nanase&);
 
   public:
 
-    Nanase(const std::string &db_path) : idxdb(db_path) {}
+    Nanase(const std::string &db_path) : idxdb(db_path), pool(NULL), warmer(NULL) {}
+
+    ~Nanase(){
+      delete warmer;
+      delete pool;
+    }
 
     void open(const std::string &db_path) {
       idxdb.open(db_path);
     }
 
     void close(){
+      if(warmer != NULL) warmer->cancel();
       idxdb.close();
     }
 
+    // Starts warming the page cache in the background, see Warmer.
+    // Returns at once, a warm-up already running is cancelled.
+    void warm(const std::string &query_log = "",
+              WarmProgress *progress = NULL,
+              size_t max_lists = Warmer::DEFAULT_MAX_LISTS){
+      delete warmer;
+      warmer = NULL;
+      warmer = new Warmer(idxdb, query_log, max_lists, progress);
+      warmer->start();
+    }
+
+    // Waits until the warm-up started by warm() has finished.
+    void wait_warm(){
+      if(warmer != NULL) warmer->wait();
+    }
+
+    // See IndexDB::set_write_buffer.
+    void set_write_buffer(size_t max_bytes, unsigned int max_age_ms){
+      idxdb.set_write_buffer(max_bytes, max_age_ms);
+    }
+
+    // See IndexDB::set_store_text and Searcher::set_snippet_context.
+    void set_store_text(bool store){
+      idxdb.set_store_text(store);
+    }
+
+    // Searchers share a pool of n threads for batch searches.
+    // n == 0 makes them run on the calling thread only.
+    void set_search_threads(size_t n){
+      delete pool;
+      pool = NULL;
+      if(n > 0) pool = new ThreadPool(n);
+    }
+
     Searcher get_searcher(){
-      return Searcher(idxdb);
+      return Searcher(idxdb, pool);
     }
 
     Indexer get_indexer(){
@@ -0,0 +1,253 @@
+// Copyright (C) 2010 Masahiko Higashiyama
+//
+// Permission is hereby granted, free of charge, to any person obtaining a
+// copy of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+// Offline docid reassignment.
+//
+// Docids are handed out in arrival order, so similar documents are spread
+// over the whole docid space. This tool copies an index into a new one,
+// renumbering the documents so that similar ones get adjacent docids,
+// which shrinks the docid gaps in posting lists and lets a query touch
+// fewer, denser regions of each list.
+//
+// usage: nanase_reorder [-m url|content] src.idx dst.idx [query ...]
+//
+//   url      sort by URL with the host name reversed
+//            (jp.co.yahoo.www/...), which groups sites and domains.
+//   content  sort by a min-hash of the bigrams of each document, which
+//            groups documents sharing rare bigrams. Ties fall back to url.
+//
+// The given queries are timed on both indexes.
+
+#include "indexdb.hpp"
+#include "searcher.hpp"
+#include "docinfo.hpp"
+#include "posting.hpp"
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <unistd.h>
+using namespace std;
+using namespace nanase;
+
+namespace {
+  struct Document {
+    int docid;
+    uint64_t minhash[2];
+    string sortkey;
+    string url;
+    string title;
+    size_t wordnum;
+  };
+
+  struct CompareDocument {
+    bool operator()(const Document &a, const Document &b) const {
+      if(a.minhash[0] != b.minhash[0]) return a.minhash[0] < b.minhash[0];
+      if(a.minhash[1] != b.minhash[1]) return a.minhash[1] < b.minhash[1];
+      if(a.sortkey != b.sortkey) return a.sortkey < b.sortkey;
+      return a.docid < b.docid;
+    }
+  };
+
+  // "http://www.yahoo.co.jp/a" => "jp.co.yahoo.www/a"
+  string ReversedHostKey(const string &url){
+    size_t begin = url.find("://");
+    begin = (begin == string::npos) ? 0 : begin + 3;
+    size_t end = url.find('/', begin);
+    if(end == string::npos) end = url.size();
+    string host = url.substr(begin, end - begin);
+    string key;
+    size_t p = host.size();
+    while(p != string::npos){
+      size_t dot = (p == 0) ? string::npos : host.rfind('.', p - 1);
+      size_t from = (dot == string::npos) ? 0 : dot + 1;
+      if(!key.empty()) key += '.';
+      key += host.substr(from, p - from);
+      p = dot;
+    }
+    return key + url.substr(end);
+  }
+
+  uint64_t KeyHash(const string &key, uint64_t seed){
+    uint64_t h = seed ^ 14695981039346656037ULL;
+    for(size_t i = 0; i < key.size(); i++){
+      h ^= static_cast<unsigned char>(key[i]);
+      h *= 1099511628211ULL;
+    }
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    return h;
+  }
+
+  // Bytes the posting lists would take with varint coded docid gaps,
+  // the usual proxy for how compressible a docid order is.
+  uint64_t GapBytes(const PostingList &m){
+    uint64_t bytes = 0;
+    int prev = 0;
+    for(size_t i = 0; i < m.size(); i++){
+      unsigned int gap = posting_docid(m[i]) - prev;
+      prev = posting_docid(m[i]);
+      do { bytes++; gap >>= 7; } while(gap != 0);
+    }
+    return bytes;
+  }
+
+  double Now(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+  }
+
+  double QueryLatency(IndexDB &idxdb, const vector<const char *> &queries){
+    const int repeat = 10;
+    Searcher searcher(idxdb);
+    double start = Now();
+    for(int r = 0; r < repeat; r++){
+      for(size_t i = 0; i < queries.size(); i++)
+        searcher.search(queries[i]);
+    }
+    return (Now() - start) / (repeat * queries.size()) * 1e3;
+  }
+
+  void Usage(){
+    cerr << "usage: nanase_reorder [-m url|content] src.idx dst.idx [query ...]"
+         << endl;
+    exit(1);
+  }
+}
+
+int main(int argc, char *argv[])
+{
+  bool by_content = false;
+  int opt;
+  while((opt = getopt(argc, argv, "m:")) != -1){
+    if(opt != 'm') Usage();
+    if(strcmp(optarg, "content") == 0) by_content = true;
+    else if(strcmp(optarg, "url") != 0) Usage();
+  }
+  if(argc - optind < 2) Usage();
+  const char *src_path = argv[optind];
+  const char *dst_path = argv[optind + 1];
+  vector<const char *> queries(argv + optind + 2, argv + argc);
+
+  if(access(dst_path, F_OK) == 0){
+    cerr << dst_path << " already exists" << endl;
+    return 1;
+  }
+
+  try {
+    IndexDB src(src_path);
+
+    int max_docid = src.get_current_docid();
+    vector<Document> docs;
+    vector<int> slot(max_docid + 1, -1);
+    for(int docid = 1; docid <= max_docid; docid++){
+      DocInfo docinfo(docid);
+      // Documents whose indexing never finished have no DocInfo,
+      // their postings are dropped.
+      if(!src.read_docinfo(docinfo)) continue;
+      Document doc;
+      doc.docid = docid;
+      doc.minhash[0] = doc.minhash[1] = 0;
+      doc.url = docinfo.url ? docinfo.url : "";
+      doc.title = docinfo.title ? docinfo.title : "";
+      doc.wordnum = docinfo.wordnum;
+      doc.sortkey = ReversedHostKey(doc.url);
+      slot[docid] = docs.size();
+      docs.push_back(doc);
+    }
+
+    vector<string> keys = src.index_keys();
+
+    if(by_content){
+      for(size_t i = 0; i < docs.size(); i++)
+        docs[i].minhash[0] = docs[i].minhash[1] = ~0ULL;
+      for(size_t k = 0; k < keys.size(); k++){
+        uint64_t h[2] = { KeyHash(keys[k], 0), KeyHash(keys[k], 1) };
+        PostingList m = src.read_index_raw(keys[k]);
+        for(size_t i = 0; i < m.size(); i++){
+          int docid = posting_docid(m[i]);
+          if(docid > max_docid || slot[docid] < 0) continue;
+          Document &doc = docs[slot[docid]];
+          doc.minhash[0] = min(doc.minhash[0], h[0]);
+          doc.minhash[1] = min(doc.minhash[1], h[1]);
+        }
+      }
+    }
+
+    sort(docs.begin(), docs.end(), CompareDocument());
+    vector<int> new_docid(max_docid + 1, 0);
+    for(size_t i = 0; i < docs.size(); i++)
+      new_docid[docs[i].docid] = i + 1;
+
+    IndexDB dst(dst_path);
+    for(size_t i = 0; i < docs.size(); i++){
+      DocInfo docinfo(i + 1, docs[i].url.c_str(), docs[i].title.c_str());
+      docinfo.wordnum = docs[i].wordnum;
+      dst.write_docinfo(docinfo);
+      string block;
+      for(int b = 0; src.read_text_block(docs[i].docid, b, block); b++)
+        dst.write_text_block(i + 1, b, block.data(), block.size());
+    }
+
+    uint64_t src_gap_bytes = 0, dst_gap_bytes = 0;
+    for(size_t k = 0; k < keys.size(); k++){
+      PostingList m = src.read_index_raw(keys[k]);
+      PostingList renumbered;
+      renumbered.reserve(m.size());
+      for(size_t i = 0; i < m.size(); i++){
+        int docid = posting_docid(m[i]);
+        if(docid > max_docid || new_docid[docid] == 0) continue;
+        renumbered.push_back(make_posting(new_docid[docid],
+                                          posting_pos(m[i])));
+      }
+      sort(renumbered.begin(), renumbered.end());
+      src_gap_bytes += GapBytes(m);
+      dst_gap_bytes += GapBytes(renumbered);
+      if(!renumbered.empty()) dst.write_index_raw(keys[k], renumbered);
+    }
+    dst.set_current_docid(docs.size());
+
+    cout << "documents:      " << docs.size() << endl;
+    cout << "posting keys:   " << keys.size() << endl;
+    cout << "file size:      " << src.file_size() << " -> "
+         << dst.file_size() << " bytes" << endl;
+    cout << "varint gaps:    " << src_gap_bytes << " -> "
+         << dst_gap_bytes << " bytes" << endl;
+    if(!queries.empty()){
+      cout << "query latency:  " << QueryLatency(src, queries) << " -> "
+           << QueryLatency(dst, queries) << " ms" << endl;
+    }
+
+    dst.close();
+    src.close();
+  }catch(exception &e){
+    cerr << e.what() << endl;
+    return 1;
+  }
+
+  return 0;
+}
@@ -0,0 +1,518 @@
+// Copyright (C) 2010 Masahiko Higashiyama
+//
+// Permission is hereby granted, free of charge, to any person obtaining a
+// copy of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+// nanased: search server keeping one Nanase open across requests.
+//
+// usage: nanased [-s socket_path | -p port] [-t threads] [-w] [-l query_log]
+//                db_path
+//
+// -w warms the page cache in the background while serving, with the
+// posting lists of the most frequent queries of query_log if -l is given.
+//
+// Listens on a Unix domain socket (default ./nanased.sock) or on
+// 127.0.0.1:port. The wire format is described in protocol.hpp. One
+// epoll loop handles all the connections, requests are run on a pool
+// of worker threads and their responses are handed back to the loop
+// through an eventfd.
+
+#include "nanase.hpp"
+#include "protocol.hpp"
+#include "threadpool.hpp"
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <map>
+#include <deque>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <csignal>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+using namespace std;
+using namespace nanase;
+
+namespace {
+  class SystemError : public std::runtime_error {
+  public:
+    SystemError(const string &what)
+      : std::runtime_error(what + ": " + strerror(errno)) {}
+  };
+
+  class Server {
+    // A client may send its requests and shut down its side at once, so
+    // the connection is only closed when it is read-closed and every
+    // request on it has been answered and sent.
+    struct Connection {
+      int fd;
+      string in;
+      string out;
+      size_t out_off;
+      size_t pending;
+      bool read_closed;
+      uint32_t events;
+
+      Connection(int _fd)
+        : fd(_fd), out_off(0), pending(0), read_closed(false),
+          events(EPOLLIN | EPOLLRDHUP) {}
+    };
+
+    // A connection with this many requests running, or this many bytes
+    // of responses unsent, is not read from until it catches up, so that
+    // a client which pipelines and never reads cannot make the server
+    // buffer without bound.
+    static const size_t MAX_PENDING_REQUESTS = 64;
+    static const size_t MAX_OUT_BYTES = 16 * 1024 * 1024;
+
+    struct Completion {
+      unsigned long conn_id;
+      string frame;
+    };
+
+    Nanase &nanase;
+    ThreadPool pool;
+    int epfd;
+    int listen_fd;
+    // False while out of descriptors: listen_fd is not watched until a
+    // connection closes or ACCEPT_RETRY_MS has passed.
+    bool accepting;
+    int event_fd;
+    int signal_fd;
+    unsigned long next_conn_id;
+    map<unsigned long, Connection *> conns;
+
+    pthread_mutex_t done_mutex;
+    deque<Completion> done;
+
+    // epoll data of the fixed descriptors. Connections use their id,
+    // which starts above these.
+    enum { LISTEN_ID = 1, EVENT_ID = 2, SIGNAL_ID = 3, FIRST_CONN_ID = 4 };
+
+    class RequestTask : public Task {
+      Server &server;
+      unsigned long conn_id;
+      string request;
+
+    public:
+      RequestTask(Server &_server, unsigned long _conn_id,
+                  const char *frame, size_t len)
+        : server(_server), conn_id(_conn_id), request(frame, len) {}
+
+      void run(){
+        protocol::Reader in(request.data(), request.size());
+        protocol::Writer out;
+        uint32_t request_id = 0;
+        try {
+          request_id = in.u32();
+          uint8_t op = in.u8();
+          if(op == protocol::OP_SEARCH){
+            string query = in.str();
+            Searcher searcher = server.nanase.get_searcher();
+            vector<Searcher::ResultType> results = searcher.search(query.c_str());
+            out.u32(request_id).u8(protocol::STATUS_OK).u32(results.size());
+            for(size_t i = 0; i < results.size(); i++){
+              out.i32(results[i].docid).f64(results[i].score)
+                .str(results[i].url).str(results[i].title);
+            }
+          }else if(op == protocol::OP_ADD){
+            string url = in.str();
+            string title = in.str();
+            string text = in.str();
+            Indexer indexer = server.nanase.get_indexer();
+            indexer.add(url.c_str(), title.c_str(), text.data(), text.size());
+            out.u32(request_id).u8(protocol::STATUS_OK);
+          }else{
+            throw std::invalid_argument("unknown op");
+          }
+        }catch(std::exception &e){
+          out = protocol::Writer();
+          out.u32(request_id).u8(protocol::STATUS_ERROR).str(e.what());
+        }
+        server.Complete(conn_id, out.frame());
+      }
+    };
+
+    static void SetNonBlocking(int fd){
+      int flags = fcntl(fd, F_GETFL, 0);
+      if(flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0)
+        throw SystemError("fcntl");
+    }
+
+    void Watch(int fd, uint64_t id, uint32_t events, int op = EPOLL_CTL_ADD){
+      struct epoll_event ev;
+      memset(&ev, 0, sizeof(ev));
+      ev.events = events;
+      ev.data.u64 = id;
+      if(epoll_ctl(epfd, op, fd, &ev) < 0) throw SystemError("epoll_ctl");
+    }
+
+    // Called from worker threads.
+    void Complete(unsigned long conn_id, const string &frame){
+      pthread_mutex_lock(&done_mutex);
+      done.push_back(Completion());
+      done.back().conn_id = conn_id;
+      done.back().frame = frame;
+      pthread_mutex_unlock(&done_mutex);
+      uint64_t one = 1;
+      while(write(event_fd, &one, sizeof(one)) < 0 && errno == EINTR);
+    }
+
+    static const int ACCEPT_RETRY_MS = 100;
+
+    void SetAccepting(bool on){
+      if(on == accepting) return;
+      Watch(listen_fd, LISTEN_ID, on ? EPOLLIN : 0, EPOLL_CTL_MOD);
+      accepting = on;
+    }
+
+    // Failures of a single connection are logged and the server goes on.
+    void Accept(){
+      for(;;){
+        int fd = accept(listen_fd, NULL, NULL);
+        if(fd < 0){
+          if(errno == EINTR) continue;
+          if(errno == EAGAIN || errno == EWOULDBLOCK) return;
+          int err = errno;
+          if(err != ECONNABORTED && err != EPROTO && err != EMFILE
+             && err != ENFILE && err != ENOBUFS && err != ENOMEM)
+            throw SystemError("accept");
+          cerr << "nanased: accept: " << strerror(err) << endl;
+          if(err == ECONNABORTED || err == EPROTO) continue;
+          SetAccepting(false);
+          return;
+        }
+        unsigned long id = next_conn_id++;
+        try {
+          SetNonBlocking(fd);
+          Watch(fd, id, EPOLLIN | EPOLLRDHUP);
+        }catch(SystemError &e){
+          cerr << "nanased: " << e.what() << endl;
+          close(fd);
+          continue;
+        }
+        conns[id] = new Connection(fd);
+      }
+    }
+
+    void Close(unsigned long id){
+      map<unsigned long, Connection *>::iterator itr = conns.find(id);
+      if(itr == conns.end()) return;
+      close(itr->second->fd);
+      delete itr->second;
+      conns.erase(itr);
+      SetAccepting(true);
+    }
+
+    static bool Throttled(const Connection &conn){
+      return conn.pending >= MAX_PENDING_REQUESTS
+        || conn.out.size() - conn.out_off >= MAX_OUT_BYTES;
+    }
+
+    // Submits the complete frames received, as many as the limits allow.
+    // Returns false if the connection has been closed.
+    bool Submit(unsigned long id, Connection &conn){
+      size_t off = 0;
+      const char *frame;
+      size_t len;
+      try {
+        while(!Throttled(conn)
+              && protocol::next_frame(conn.in, &off, &frame, &len)){
+          pool.submit(new RequestTask(*this, id, frame, len));
+          conn.pending++;
+        }
+      }catch(std::length_error &){
+        Close(id);
+        return false;
+      }
+      conn.in.erase(0, off);
+      return true;
+    }
+
+    // Closes the connection once it is done, otherwise watches it for
+    // what it is waiting for.
+    void Update(unsigned long id, Connection &conn){
+      bool unsent = conn.out_off < conn.out.size();
+      if(conn.read_closed && conn.pending == 0 && !unsent){
+        Close(id);
+        return;
+      }
+      uint32_t events = (conn.read_closed || Throttled(conn))
+        ? 0 : (EPOLLIN | EPOLLRDHUP);
+      if(unsent) events |= EPOLLOUT;
+      if(events != conn.events){
+        Watch(conn.fd, id, events, EPOLL_CTL_MOD);
+        conn.events = events;
+      }
+    }
+
+    void Read(unsigned long id, Connection &conn){
+      char buf[64 * 1024];
+      while(!conn.read_closed){
+        if(!Submit(id, conn)) return;
+        if(Throttled(conn)) break;
+        ssize_t n = read(conn.fd, buf, sizeof(buf));
+        if(n < 0){
+          if(errno == EINTR) continue;
+          if(errno == EAGAIN || errno == EWOULDBLOCK) break;
+          Close(id);
+          return;
+        }
+        // An incomplete frame left at EOF is dropped.
+        if(n == 0) conn.read_closed = true;
+        conn.in.append(buf, n);
+      }
+      if(!Submit(id, conn)) return;
+      Update(id, conn);
+    }
+
+    // Returns false if the connection has been closed.
+    bool Flush(unsigned long id, Connection &conn){
+      while(conn.out_off < conn.out.size()){
+        ssize_t n = send(conn.fd, conn.out.data() + conn.out_off,
+                         conn.out.size() - conn.out_off, MSG_NOSIGNAL);
+        if(n < 0){
+          if(errno == EINTR) continue;
+          if(errno == EAGAIN || errno == EWOULDBLOCK) break;
+          Close(id);
+          return false;
+        }
+        conn.out_off += n;
+      }
+      if(conn.out_off == conn.out.size()){
+        conn.out.clear();
+        conn.out_off = 0;
+      }
+      return true;
+    }
+
+    // Flushes and, if the connection has room again, resumes it.
+    void Resume(unsigned long id, Connection &conn){
+      if(!Flush(id, conn) || !Submit(id, conn)) return;
+      Update(id, conn);
+    }
+
+    void DeliverCompletions(){
+      uint64_t count;
+      while(read(event_fd, &count, sizeof(count)) < 0 && errno == EINTR);
+
+      deque<Completion> ready;
+      pthread_mutex_lock(&done_mutex);
+      ready.swap(done);
+      pthread_mutex_unlock(&done_mutex);
+
+      map<unsigned long, Connection *> touched;
+      for(size_t i = 0; i < ready.size(); i++){
+        // The client may have gone away while its request was running.
+        map<unsigned long, Connection *>::iterator itr
+          = conns.find(ready[i].conn_id);
+        if(itr == conns.end()) continue;
+        itr->second->out += ready[i].frame;
+        itr->second->pending--;
+        touched.insert(*itr);
+      }
+      for(map<unsigned long, Connection *>::iterator itr = touched.begin();
+          itr != touched.end(); ++itr){
+        Resume(itr->first, *itr->second);
+      }
+    }
+
+    Server(const Server &);
+    Server &operator=(const Server &);
+
+  public:
+    Server(Nanase &_nanase, int _listen_fd, size_t nthreads)
+      : nanase(_nanase), pool(nthreads), epfd(-1), listen_fd(_listen_fd),
+        accepting(true),
+        event_fd(-1), signal_fd(-1), next_conn_id(FIRST_CONN_ID) {
+      pthread_mutex_init(&done_mutex, NULL);
+
+      // SIGINT and SIGTERM are blocked in main before any thread starts,
+      // and are received here instead.
+      sigset_t mask;
+      sigemptyset(&mask);
+      sigaddset(&mask, SIGINT);
+      sigaddset(&mask, SIGTERM);
+
+      if((epfd = epoll_create(64)) < 0) throw SystemError("epoll_create");
+      if((event_fd = eventfd(0, EFD_NONBLOCK)) < 0) throw SystemError("eventfd");
+      if((signal_fd = signalfd(-1, &mask, SFD_NONBLOCK)) < 0)
+        throw SystemError("signalfd");
+      SetNonBlocking(listen_fd);
+      Watch(listen_fd, LISTEN_ID, EPOLLIN);
+      Watch(event_fd, EVENT_ID, EPOLLIN);
+      Watch(signal_fd, SIGNAL_ID, EPOLLIN);
+    }
+
+    ~Server(){
+      // Let the running requests finish before the connections go away.
+      pool.shutdown();
+      while(!conns.empty()) Close(conns.begin()->first);
+      close(signal_fd);
+      close(event_fd);
+      close(epfd);
+      pthread_mutex_destroy(&done_mutex);
+    }
+
+    // Runs until SIGINT or SIGTERM.
+    void run(){
+      struct epoll_event events[64];
+      for(;;){
+        int n = epoll_wait(epfd, events, 64,
+                           accepting ? -1 : ACCEPT_RETRY_MS);
+        if(n < 0){
+          if(errno == EINTR) continue;
+          throw SystemError("epoll_wait");
+        }
+        // Descriptors may have been freed by others than our connections.
+        if(n == 0) SetAccepting(true);
+        for(int i = 0; i < n; i++){
+          uint64_t id = events[i].data.u64;
+          if(id == LISTEN_ID){
+            Accept();
+          }else if(id == EVENT_ID){
+            DeliverCompletions();
+          }else if(id == SIGNAL_ID){
+            return;
+          }else{
+            map<unsigned long, Connection *>::iterator itr = conns.find(id);
+            if(itr == conns.end()) continue;
+            Connection &conn = *itr->second;
+            if(events[i].events & (EPOLLERR | EPOLLHUP)){
+              Close(id);
+              continue;
+            }
+            if(events[i].events & EPOLLOUT) Resume(id, conn);
+            if(conns.count(id) && (events[i].events & (EPOLLIN | EPOLLRDHUP)))
+              Read(id, conn);
+          }
+        }
+      }
+    }
+  };
+
+  int ListenUnix(const char *path){
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if(strlen(path) >= sizeof(addr.sun_path))
+      throw std::invalid_argument("socket path too long");
+    strcpy(addr.sun_path, path);
+    unlink(path);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(fd < 0) throw SystemError("socket");
+    if(bind(fd, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr)) < 0)
+      throw SystemError(path);
+    if(listen(fd, SOMAXCONN) < 0) throw SystemError("listen");
+    return fd;
+  }
+
+  int ListenTCP(int port){
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if(fd < 0) throw SystemError("socket");
+    int on = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    if(bind(fd, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr)) < 0)
+      throw SystemError("bind");
+    if(listen(fd, SOMAXCONN) < 0) throw SystemError("listen");
+    return fd;
+  }
+
+  class WarmLog : public WarmProgress {
+  public:
+    void progress(size_t done, size_t total){
+      if(done == total) cerr << "nanased: warmed up" << endl;
+    }
+    void error(const string &what){
+      cerr << "nanased: warm-up: " << what << endl;
+    }
+  };
+
+  void Usage(){
+    cerr << "usage: nanased [-s socket_path | -p port] [-t threads] [-w]"
+         << " [-l query_log] db_path" << endl;
+    exit(1);
+  }
+}
+
+int main(int argc, char *argv[])
+{
+  const char *socket_path = "nanased.sock";
+  int port = 0;
+  long nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+  bool warm = false;
+  string query_log;
+  int opt;
+  while((opt = getopt(argc, argv, "s:p:t:wl:")) != -1){
+    switch(opt){
+    case 's': socket_path = optarg; break;
+    case 'p': port = atoi(optarg); break;
+    case 't': nthreads = atol(optarg); break;
+    case 'w': warm = true; break;
+    case 'l': warm = true; query_log = optarg; break;
+    default: Usage();
+    }
+  }
+  if(argc - optind != 1 || nthreads < 1) Usage();
+
+  sigset_t mask;
+  sigemptyset(&mask);
+  sigaddset(&mask, SIGINT);
+  sigaddset(&mask, SIGTERM);
+  pthread_sigmask(SIG_BLOCK, &mask, NULL);
+
+  int status = 0;
+  WarmLog warm_log;
+  try {
+    Nanase nanase(argv[optind]);
+    if(warm) nanase.warm(query_log, &warm_log);
+    try {
+      int listen_fd = (port > 0) ? ListenTCP(port) : ListenUnix(socket_path);
+      {
+        Server server(nanase, listen_fd, nthreads);
+        server.run();
+      }
+      close(listen_fd);
+      if(port == 0) unlink(socket_path);
+    }catch(std::exception &e){
+      cerr << e.what() << endl;
+      status = 1;
+    }
+    nanase.close();
+  }catch(std::exception &e){
+    cerr << e.what() << endl;
+    status = 1;
+  }
+
+  return status;
+}
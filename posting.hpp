@@ -0,0 +1,94 @@
+// Copyright (C) 2010 Masahiko Higashiyama
+//
+// Permission is hereby granted, free of charge, to any person obtaining a
+// copy of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifndef POSTING_HPP
+#define POSTING_HPP
+
+#include <stdint.h>
+#include <cstring>
+#include <stdexcept>
+#include <vector>
+#include "arena.hpp"
+
+namespace nanase {
+  // A posting is packed into one 64bit integer, docid in the upper half
+  // and position in the lower half. So a posting list sorted as integers
+  // is sorted by (docid, position), and "b is just before a" becomes
+  // "b + distance == a", which the intersection kernels can handle.
+  typedef uint64_t Posting;
+  typedef ArenaAllocator<Posting> PostingAllocator;
+  typedef std::vector<Posting, PostingAllocator> PostingList;
+
+  inline Posting make_posting(int docid, size_t pos){
+    return (static_cast<uint64_t>(static_cast<uint32_t>(docid)) << 32)
+      | static_cast<uint32_t>(pos);
+  }
+
+  // Typed view over stored posting records (int docid, size_t pos),
+  // read in place without copying them out one field at a time.
+  class PostingView {
+    const unsigned char *data;
+    size_t n;
+
+  public:
+    static const size_t RECORD_SIZE = sizeof(int) + sizeof(size_t);
+
+    // Throws std::length_error unless bytes is a whole number of records.
+    PostingView(const void *_data, size_t bytes)
+      : data(reinterpret_cast<const unsigned char *>(_data)),
+        n(bytes / RECORD_SIZE) {
+      if(bytes % RECORD_SIZE != 0)
+        throw std::length_error("broken posting records");
+    }
+
+    size_t size() const { return n; }
+
+    int docid(size_t i) const {
+      int docid;
+      memcpy(&docid, data + i * RECORD_SIZE, sizeof(int));
+      return docid;
+    }
+
+    size_t pos(size_t i) const {
+      size_t pos;
+      memcpy(&pos, data + i * RECORD_SIZE + sizeof(int), sizeof(size_t));
+      return pos;
+    }
+
+    Posting operator[](size_t i) const {
+      return make_posting(docid(i), pos(i));
+    }
+
+    Posting at(size_t i) const {
+      if(i >= n) throw std::out_of_range("PostingView::at");
+      return (*this)[i];
+    }
+  };
+
+  inline int posting_docid(Posting p){
+    return static_cast<int>(p >> 32);
+  }
+
+  inline size_t posting_pos(Posting p){
+    return static_cast<size_t>(p & 0xffffffffULL);
+  }
+};
+
+#endif /* POSTING_HPP */
@@ -0,0 +1,177 @@
+// Copyright (C) 2010 Masahiko Higashiyama
+//
+// Permission is hereby granted, free of charge, to any person obtaining a
+// copy of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#ifndef PROTOCOL_HPP
+#define PROTOCOL_HPP
+
+#include <stdint.h>
+#include <cstring>
+#include <string>
+#include <stdexcept>
+#include <arpa/inet.h>
+
+// Wire format of nanased.
+//
+// Every message is a frame: a 4 byte length followed by that many bytes.
+// Integers are in network byte order, doubles are sent as the big endian
+// image of their IEEE 754 representation, and strings as a 4 byte length
+// followed by the bytes.
+//
+//   request:  u32 request_id, u8 op, arguments
+//     OP_SEARCH  str query
+//     OP_ADD     str url, str title, str text
+//
+//   response: u32 request_id, u8 status, body
+//     STATUS_ERROR             str message
+//     OP_SEARCH, STATUS_OK     u32 n, n * (i32 docid, f64 score,
+//                                           str url, str title)
+//     OP_ADD, STATUS_OK        (empty)
+//
+// Requests may be pipelined. Responses carry the request id and may come
+// back in a different order than the requests were sent.
+namespace nanase {
+  namespace protocol {
+    enum Op {
+      OP_SEARCH = 1,
+      OP_ADD = 2
+    };
+
+    enum Status {
+      STATUS_OK = 0,
+      STATUS_ERROR = 1
+    };
+
+    const uint32_t MAX_FRAME_SIZE = 64 * 1024 * 1024;
+
+    class Writer {
+      std::string buf;
+
+    public:
+      // Room for the frame length, filled by frame().
+      Writer() : buf(4, '\0') {}
+
+      Writer &u8(uint8_t v){
+        buf.push_back(static_cast<char>(v));
+        return *this;
+      }
+
+      Writer &u32(uint32_t v){
+        v = htonl(v);
+        buf.append(reinterpret_cast<const char *>(&v), sizeof(v));
+        return *this;
+      }
+
+      Writer &i32(int32_t v){
+        return u32(static_cast<uint32_t>(v));
+      }
+
+      Writer &f64(double d){
+        uint64_t v;
+        memcpy(&v, &d, sizeof(v));
+        u32(static_cast<uint32_t>(v >> 32));
+        return u32(static_cast<uint32_t>(v));
+      }
+
+      Writer &str(const char *s, size_t len){
+        u32(len);
+        buf.append(s, len);
+        return *this;
+      }
+
+      Writer &str(const std::string &s){
+        return str(s.data(), s.size());
+      }
+
+      const std::string &frame(){
+        uint32_t len = htonl(buf.size() - 4);
+        memcpy(&buf[0], &len, sizeof(len));
+        return buf;
+      }
+    };
+
+    // Reads the body of a frame. Running off the end throws
+    // std::length_error.
+    class Reader {
+      const char *data;
+      size_t len;
+      size_t off;
+
+      const char *Take(size_t n){
+        if(len - off < n) throw std::length_error("truncated frame");
+        const char *p = data + off;
+        off += n;
+        return p;
+      }
+
+    public:
+      Reader(const char *_data, size_t _len)
+        : data(_data), len(_len), off(0) {}
+
+      uint8_t u8(){
+        return static_cast<uint8_t>(*Take(1));
+      }
+
+      uint32_t u32(){
+        uint32_t v;
+        memcpy(&v, Take(sizeof(v)), sizeof(v));
+        return ntohl(v);
+      }
+
+      int32_t i32(){
+        return static_cast<int32_t>(u32());
+      }
+
+      double f64(){
+        uint64_t v = static_cast<uint64_t>(u32()) << 32;
+        v |= u32();
+        double d;
+        memcpy(&d, &v, sizeof(d));
+        return d;
+      }
+
+      std::string str(){
+        uint32_t n = u32();
+        return std::string(Take(n), n);
+      }
+
+      bool eof() const { return off == len; }
+    };
+
+    // Finds the frame starting at buf[*off]. Returns false if it has not
+    // been received completely yet, throws std::length_error if it is
+    // larger than MAX_FRAME_SIZE.
+    inline bool next_frame(const std::string &buf, size_t *off,
+                           const char **frame, size_t *frame_len){
+      if(buf.size() - *off < 4) return false;
+      uint32_t len;
+      memcpy(&len, buf.data() + *off, sizeof(len));
+      len = ntohl(len);
+      if(len > MAX_FRAME_SIZE) throw std::length_error("frame too large");
+      if(buf.size() - *off - 4 < len) return false;
+      *frame = buf.data() + *off + 4;
+      *frame_len = len;
+      *off += 4 + len;
+      return true;
+    }
+  }
+};
+
+#endif /* PROTOCOL_HPP */
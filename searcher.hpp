@@ -24,20 +24,28 @@
 #include <vector>
 #include <map>
 #include <algorithm>
+#include <cmath>
 #include "utf8.hpp"
 #include "indexdb.hpp"
 #include "docinfo.hpp"
+#include "posting.hpp"
+#include "intersect.hpp"
+#include "threadpool.hpp"
+#include "arena.hpp"
+#include "budget.hpp"
 
 namespace nanase {
   class Searcher {
 
     IndexDB &idxdb;
+    int generation;
+    ThreadPool *pool;
+    size_t snippet_context;
+    size_t snippet_results;
+    // Documents of the snapshot which failed half way.
+    std::vector<int> aborted;
 
-    typedef int DocumentID;
-    typedef size_t Position;
-    typedef std::multimap<DocumentID, Position> IdxType;
-    typedef std::pair<IdxType::const_iterator,
-                      IdxType::const_iterator> IdxTypeRange;
+    typedef PostingList IdxType;
 
   public:
     struct ResultType {
@@ -46,9 +54,18 @@ namespace nanase {
       std::string url;
       std::string title;
 
+      // Text around the first match, if the index stores texts, snippets
+      // are enabled and the result is among the best ones (see
+      // set_snippet_context), and the byte ranges [first, second) of the
+      // matches in it.
+      std::string snippet;
+      std::vector<std::pair<size_t, size_t> > highlights;
+      // Character position of the first match.
+      size_t pos;
+
       ResultType(int _docid, double _score,
                  const std::string &_url = "", const std::string &_title = "")
-        : docid(_docid), score(_score), url(_url), title(_title) {}
+        : docid(_docid), score(_score), url(_url), title(_title), pos(0) {}
 
       ~ResultType(){}
     };
@@ -61,80 +78,452 @@ namespace nanase {
 
   private:
 
-    static void _CheckConnection(const IdxType &a, IdxType &b, int distance){
-      IdxType::iterator itr = b.begin();
-      while(itr != b.end()){
-        IdxTypeRange found = a.equal_range(itr->first);
-        bool connected = false;
-        for(IdxType::const_iterator itr2 = found.first;
-            itr2 != found.second; ++itr2){
-          if(itr->second + distance == itr2->second){
-            connected = true;
-          }
-        }
-        if(connected)
-          ++itr;
-        else
-          b.erase(itr++);
+    // Temporaries of a query are allocated from the arena of the thread
+    // running it (see Arena) and freed at once when the query ends.
+    struct Bigram {
+      const char *ptr;
+      size_t len;
+    };
+    typedef std::vector<Bigram, ArenaAllocator<Bigram> > BigramList;
+    typedef std::vector<IdxType, ArenaAllocator<IdxType> > IdxTypeList;
+    typedef std::vector<const IdxType *,
+                        ArenaAllocator<const IdxType *> > IdxTypePtrList;
+    // Score of a document and the character position of its first match.
+    struct DocScore {
+      int docid;
+      double score;
+      size_t pos;
+      DocScore(int _docid, double _score, size_t _pos)
+        : docid(_docid), score(_score), pos(_pos) {}
+    };
+    typedef std::vector<DocScore, ArenaAllocator<DocScore> > ScoreList;
+
+    // Leave in out only the postings of b which are followed by a posting
+    // of a at the given distance in the same document.
+    static void _CheckConnection(const Posting *a, size_t na,
+                                 const Posting *b, size_t nb,
+                                 int distance, IdxType &out){
+      if(na == 0 || nb == 0){
+        out.clear();
+        return;
       }
+      out.resize(std::min(na, nb));
+      size_t n = intersect(a, na, b, nb, static_cast<Posting>(distance),
+                           &out[0]);
+      out.resize(n);
     }
 
-    // Argument vector will be destroyed.
-    static IdxType& CheckConnection(std::vector<IdxType> &v, size_t char_num){
-      for(size_t i = v.size() - 1; i > 0; i--){
-        _CheckConnection(v[i], v[i-1], (char_num == 2 * i + 1) ? 1 : 2);
+    // Postings of m in [lo, hi).
+    static void PostingRange(const IdxType &m, Posting lo, Posting hi,
+                             const Posting **begin, size_t *size){
+      IdxType::const_iterator first = std::lower_bound(m.begin(), m.end(), lo);
+      IdxType::const_iterator last = std::lower_bound(first, m.end(), hi);
+      *begin = (first == last) ? NULL : &*first;
+      *size = last - first;
+    }
+
+    // Only the postings in [lo, hi) are considered, so that a query can
+    // be verified by docid ranges. Posting lists are not modified, so
+    // they can be shared among queries and threads. If the budget runs
+    // out half way, nothing is returned.
+    static IdxType CheckConnection(const IdxTypePtrList &v, size_t char_num,
+                                   Arena *arena, Posting lo = 0,
+                                   Posting hi = ~static_cast<Posting>(0),
+                                   QueryBudget *budget = NULL){
+      const Posting *p;
+      size_t n;
+      PostingRange(*v.back(), lo, hi, &p, &n);
+      IdxType cand(p, p + n, PostingAllocator(arena));
+      IdxType connected = IdxType(PostingAllocator(arena));
+      for(size_t i = v.size() - 1; i > 0 && !cand.empty(); i--){
+        PostingRange(*v[i-1], lo, hi, &p, &n);
+        if(budget != NULL && !budget->charge_postings(cand.size() + n)){
+          cand.clear();
+          break;
+        }
+        _CheckConnection(&cand[0], cand.size(), p, n,
+                         (char_num == 2 * i + 1) ? 1 : 2, connected);
+        cand.swap(connected);
       }
-      return v[0];
+      return cand;
     }
 
-    std::map<size_t, double> ExactMatch(const char* query,
-                                        const char* ns = "") const {
-      std::vector<IdxType> v;
+    // This code is a bit complicated due to performance.
+    // I will search with the query splitted into each two-letters,
+    // but the last two-letter maybe overlap previous two-letter.
+    // ex)
+    // input abc => search {ab, bc}  // overlapped
+    // input abcd => search {ab, cd} // not overlapped
+    // input abcde => search {ab, cd, de} // overlapped
+    // The bigrams point into the query.
+    static BigramList SplitQuery(const char *query, Arena *arena,
+                                 size_t *char_num){
+      std::vector<const char *, ArenaAllocator<const char *> >
+        str_idx = std::vector<const char *, ArenaAllocator<const char *> >(
+          ArenaAllocator<const char *>(arena));
+      const char *p = query;
+      while(*p != '\0'){
+        str_idx.push_back(p);
+        p = utf8nextchar(p);
+      }
+      *char_num = str_idx.size();
+      str_idx.push_back(p);
 
-      // This code is a bit complicated due to performance.
-      // I will search with the query splitted into each two-letters,
-      // but the last two-letter maybe overlap previous two-letter.
-      // ex)
-      // input abc => search {ab, bc}  // overlapped
-      // input abcd => search {ab, cd} // not overlapped
-      // input abcde => search {ab, cd, de} // overlapped
-      std::vector<const char *> str_idx = utf8index(query);
+      BigramList subs = BigramList(ArenaAllocator<Bigram>(arena));
       size_t i = 0;
-      size_t char_num = str_idx.size();
-      while(i < char_num){
-        const char *sub = utf8substr(str_idx[i], 2);
-        v.push_back(idxdb.read_index(sub, ns));
-        delete[] sub;
-        i += (i + 3 == char_num) ? 1 : 2;
+      while(i < *char_num){
+        Bigram sub;
+        sub.ptr = str_idx[i];
+        sub.len = str_idx[std::min(i + 2, *char_num)] - str_idx[i];
+        subs.push_back(sub);
+        i += (i + 3 == *char_num) ? 1 : 2;
+      }
+      return subs;
+    }
+
+    IdxType Fetch(const Bigram &sub, const char *ns, Arena *arena) const {
+      IdxType m = idxdb.read_index(sub.ptr, sub.len, ns,
+                                   PostingAllocator(arena));
+      // Drop the postings of documents newer than the snapshot.
+      m.erase(std::lower_bound(m.begin(), m.end(),
+                               make_posting(generation + 1, 0)), m.end());
+      if(!aborted.empty()) DropAborted(m);
+      return m;
+    }
+
+    // Both are sorted by docid.
+    void DropAborted(IdxType &m) const {
+      IdxType::iterator out = m.begin();
+      size_t a = 0;
+      for(IdxType::iterator itr = m.begin(); itr != m.end(); ++itr){
+        int docid = posting_docid(*itr);
+        while(a < aborted.size() && aborted[a] < docid) a++;
+        if(a < aborted.size() && aborted[a] == docid) continue;
+        *out++ = *itr;
+      }
+      m.erase(out, m.end());
+    }
+
+    // Whether some posting of v[0] starts a match, checking postings one
+    // by one and stopping at the first match instead of intersecting the
+    // whole lists.
+    static bool FindConnected(const IdxTypePtrList &v, size_t char_num,
+                              Arena *arena){
+      if(v.empty()) return false;
+      // offset[i] is the distance from a match start to its i-th bigram.
+      std::vector<Posting, PostingAllocator>
+        offset(v.size(), 0, PostingAllocator(arena));
+      size_t shortest = 0;
+      for(size_t i = 1; i < v.size(); i++){
+        offset[i] = offset[i-1] + ((char_num == 2 * i + 1) ? 1 : 2);
+        if(v[i]->size() < v[shortest]->size()) shortest = i;
+      }
+
+      typedef ArenaAllocator<IdxType::const_iterator> CursorAllocator;
+      std::vector<IdxType::const_iterator, CursorAllocator>
+        cursor(v.size(), IdxType::const_iterator(), CursorAllocator(arena));
+      for(size_t i = 0; i < v.size(); i++) cursor[i] = v[i]->begin();
+
+      const IdxType &drive = *v[shortest];
+      for(size_t j = 0; j < drive.size(); j++){
+        if(posting_pos(drive[j]) < offset[shortest]) continue;
+        Posting start = drive[j] - offset[shortest];
+        bool connected = true;
+        for(size_t i = 0; i < v.size() && connected; i++){
+          if(i == shortest) continue;
+          // Starts only grow, so the cursors never move back.
+          cursor[i] = std::lower_bound(cursor[i], v[i]->end(),
+                                       start + offset[i]);
+          connected = cursor[i] != v[i]->end()
+            && *cursor[i] == start + offset[i];
+        }
+        if(connected) return true;
+      }
+      return false;
+    }
+
+    // Queries with at least this many bigrams fetch their posting lists
+    // in parallel when the searcher has a pool,
+    static const size_t PARALLEL_MIN_BIGRAMS = 8;
+    // and split their verification by docid range, each range holding at
+    // least this many postings of the shortest list.
+    static const size_t PARALLEL_MIN_POSTINGS = 4096;
+    // Queries with a budget are verified by ranges of at most this many
+    // postings of the shortest list, which bounds the work done between
+    // two checks of the budget.
+    static const size_t BUDGET_RANGE_POSTINGS = 4096;
+
+    bool Parallel(size_t nbigrams) const {
+      return pool != NULL && nbigrams >= PARALLEL_MIN_BIGRAMS;
+    }
+
+    // Fetches the posting lists of the query into lists. Returns false
+    // if the query cannot match, or the budget ran out.
+    bool FetchAll(const BigramList &subs, const char *ns, Arena *arena,
+                  IdxTypeList &lists, IdxTypePtrList &v,
+                  QueryBudget *budget = NULL) const {
+      // A query containing a bigram which was never indexed cannot match,
+      // so reject it before fetching any posting list.
+      for(size_t i = 0; i < subs.size(); i++){
+        if(!idxdb.may_contain_index(subs[i].ptr, subs[i].len, ns))
+          return false;
       }
 
-      std::map<size_t, double> results;
+      // Lists fetched on other threads cannot come from this thread's
+      // arena.
+      bool parallel = Parallel(subs.size());
+      lists.resize(subs.size(),
+                   IdxType(PostingAllocator(parallel ? NULL : arena)));
+      v.resize(subs.size());
+      if(parallel){
+        std::vector<Task *> tasks;
+        for(size_t i = 0; i < subs.size(); i++)
+          tasks.push_back(new FetchTask(*this, subs[i], ns, lists[i]));
+        RunTasks(tasks);
+        for(size_t i = 0; i < subs.size(); i++){
+          if(budget != NULL && !budget->charge_postings(lists[i].size()))
+            return false;
+        }
+      }else{
+        for(size_t i = 0; i < subs.size(); i++){
+          IdxType m = Fetch(subs[i], ns, arena);
+          lists[i].swap(m);
+          if(budget != NULL && !budget->charge_postings(lists[i].size()))
+            return false;
+        }
+      }
+      for(size_t i = 0; i < subs.size(); i++) v[i] = &lists[i];
+      return !v.empty();
+    }
 
+    // Candidates are sorted by docid, so are the scores.
+    static ScoreList Evaluate(const IdxTypePtrList &v, size_t char_num,
+                              Arena *arena, Posting lo = 0,
+                              Posting hi = ~static_cast<Posting>(0),
+                              QueryBudget *budget = NULL){
+      ScoreList results = ScoreList(ArenaAllocator<DocScore>(arena));
       if(v.size() == 0) return results;
-      IdxType &cand = CheckConnection(v, char_num);
+      IdxType cand = CheckConnection(v, char_num, arena, lo, hi, budget);
       for(IdxType::iterator itr = cand.begin(); itr != cand.end(); ++itr){
-        results[itr->first] += 1.0;
+        int docid = posting_docid(*itr);
+        if(results.empty() || results.back().docid != docid)
+          results.push_back(DocScore(docid, 0.0, posting_pos(*itr)));
+        results.back().score += 1.0;
+      }
+      return results;
+    }
+
+    // Evaluate, split by docid range over the pool for long queries,
+    // and into small ranges for queries with a budget. Matches never
+    // span documents, so the ranges are independent and their results,
+    // concatenated in order, are those of the whole. A range the budget
+    // ran out in contributes nothing.
+    ScoreList Verify(const IdxTypePtrList &v, size_t char_num,
+                     Arena *arena, QueryBudget *budget = NULL) const {
+      const IdxType *shortest = v.empty() ? NULL : v[0];
+      for(size_t i = 1; i < v.size(); i++){
+        if(v[i]->size() < shortest->size()) shortest = v[i];
+      }
+      size_t nranges = 1;
+      bool parallel = Parallel(v.size());
+      if(parallel){
+        nranges = std::min(pool->size() + 1,
+                           shortest->size() / PARALLEL_MIN_POSTINGS);
+      }
+      if(budget != NULL){
+        nranges = std::max(nranges,
+                           shortest->size() / BUDGET_RANGE_POSTINGS + 1);
       }
+      if(nranges <= 1) return Evaluate(v, char_num, arena, 0,
+                                       ~static_cast<Posting>(0), budget);
 
+      // Cut the shortest list into equal parts, at document boundaries.
+      std::vector<Posting> bounds(1, 0);
+      for(size_t k = 1; k < nranges; k++){
+        Posting bound = make_posting(
+          posting_docid((*shortest)[k * shortest->size() / nranges]), 0);
+        if(bound > bounds.back()) bounds.push_back(bound);
+      }
+      bounds.push_back(~static_cast<Posting>(0));
+
+      ScoreList results = ScoreList(ArenaAllocator<DocScore>(arena));
+      if(!parallel){
+        for(size_t k = 0; k + 1 < bounds.size(); k++){
+          if(budget != NULL && !budget->check()) break;
+          ScoreList part = Evaluate(v, char_num, arena, bounds[k],
+                                    bounds[k+1], budget);
+          results.insert(results.end(), part.begin(), part.end());
+        }
+        return results;
+      }
+
+      std::vector<std::vector<DocScore> > partial(bounds.size() - 1);
+      std::vector<Task *> tasks;
+      for(size_t k = 0; k + 1 < bounds.size(); k++){
+        tasks.push_back(new VerifyTask(v, char_num, bounds[k], bounds[k+1],
+                                       budget, partial[k]));
+      }
+      RunTasks(tasks);
+
+      for(size_t k = 0; k < partial.size(); k++)
+        results.insert(results.end(), partial[k].begin(), partial[k].end());
       return results;
     }
 
-    void _Search(const char* query, std::vector<ResultType> &results) const {
-      std::map<size_t, double> scores = ExactMatch(query, "");
-      int max_document_num  = idxdb.get_current_docid();
+    ScoreList ExactMatch(const char* query, const char* ns, Arena *arena,
+                         QueryBudget *budget = NULL) const {
+      size_t char_num;
+      BigramList subs = SplitQuery(query, arena, &char_num);
+      IdxTypeList lists = IdxTypeList(ArenaAllocator<IdxType>(arena));
+      IdxTypePtrList v = IdxTypePtrList(ArenaAllocator<const IdxType *>(arena));
+      if(!FetchAll(subs, ns, arena, lists, v, budget))
+        return ScoreList(ArenaAllocator<DocScore>(arena));
+      return Verify(v, char_num, arena, budget);
+    }
+
+    // Cuts the text around the first match out of the stored blocks,
+    // reading only those the snippet overlaps.
+    void MakeSnippet(const char *query, ResultType &result) const {
+      size_t pos = result.pos;
+      size_t query_chars = 0;
+      for(const char *p = query; *p != '\0'; p = utf8nextchar(p))
+        query_chars++;
+      size_t begin = (pos > snippet_context) ? pos - snippet_context : 0;
+      size_t end = pos + query_chars + snippet_context;
+
+      const size_t N = IndexDB::TEXT_BLOCK_CHARS;
+      std::string text, block;
+      for(size_t b = begin / N; b <= (end - 1) / N; b++){
+        if(!idxdb.read_text_block(result.docid, b, block)) break;
+        text += block;
+      }
+
+      size_t skip = begin - begin / N * N, i = 0, chars = 0;
+      for(; i < text.size() && chars < skip; chars++)
+        i += utf8textcharlen(text[i]);
+      size_t first = i;
+      for(chars = 0; i < text.size() && chars < end - begin; chars++)
+        i += utf8textcharlen(text[i]);
+      result.snippet.assign(text, first, std::min(i, text.size()) - first);
+
+      size_t len = strlen(query);
+      for(size_t h = result.snippet.find(query); h != std::string::npos;
+          h = result.snippet.find(query, h + len))
+        result.highlights.push_back(std::make_pair(h, h + len));
+    }
+
+    // Documents whose DocInfo is not read within the budget are left out.
+    void Score(const char *query, const ScoreList &scores,
+               std::vector<ResultType> &results, Arena *arena,
+               QueryBudget *budget = NULL) const {
+      int max_document_num  = generation;
       double idf = log(static_cast<double>(1 + max_document_num)
                        / static_cast<double>(scores.size()));
 
-      for(std::map<size_t, double>::iterator itr = scores.begin();
+      results.reserve(scores.size());
+      for(ScoreList::const_iterator itr = scores.begin();
           itr != scores.end(); ++itr){
-        DocInfo docinfo(itr->first);
+        if(budget != NULL && !budget->charge_docinfo()) break;
+        DocInfo docinfo(itr->docid, arena);
         if(!idxdb.read_docinfo(docinfo)) continue;
-        results.push_back(ResultType(itr->first,
-                                     idf * itr->second
+        results.push_back(ResultType(itr->docid,
+                                     idf * itr->score
                                      / static_cast<double>(docinfo.wordnum),
-                                     docinfo.url,
-                                     docinfo.title));
+                                     docinfo.url ? docinfo.url : "",
+                                     docinfo.title ? docinfo.title : ""));
+        results.back().pos = itr->pos;
+      }
+      std::sort(results.begin(), results.end(), CompareResult());
+
+      // Only the results which will be shown get a snippet.
+      if(snippet_context == 0) return;
+      for(size_t i = 0; i < std::min(results.size(), snippet_results); i++)
+        MakeSnippet(query, results[i]);
+    }
+
+    void _Search(const char* query, std::vector<ResultType> &results,
+                 QueryBudget *budget = NULL) const {
+      Arena &arena = Arena::for_thread();
+      ArenaScope scope(arena);
+      Score(query, ExactMatch(query, "", &arena, budget), results, &arena,
+            budget);
+    }
+
+    // Tasks run on the pool. Lists shared between threads are allocated
+    // on the heap, the temporaries of each task from the arena of the
+    // thread running it.
+    class FetchTask : public Task {
+      const Searcher &searcher;
+      Bigram sub;
+      const char *ns;
+      IdxType &list;
+    public:
+      FetchTask(const Searcher &_searcher, const Bigram &_sub,
+                const char *_ns, IdxType &_list)
+        : searcher(_searcher), sub(_sub), ns(_ns), list(_list) {}
+      void run(){
+        IdxType m = searcher.Fetch(sub, ns, NULL);
+        list.swap(m);
+      }
+    };
+
+    class VerifyTask : public Task {
+      const IdxTypePtrList &v;
+      size_t char_num;
+      Posting lo;
+      Posting hi;
+      QueryBudget *budget;
+      std::vector<DocScore> &results;
+    public:
+      VerifyTask(const IdxTypePtrList &_v, size_t _char_num,
+                 Posting _lo, Posting _hi, QueryBudget *_budget,
+                 std::vector<DocScore> &_results)
+        : v(_v), char_num(_char_num), lo(_lo), hi(_hi), budget(_budget),
+          results(_results) {}
+      void run(){
+        if(budget != NULL && !budget->check()) return;
+        Arena &arena = Arena::for_thread();
+        ArenaScope scope(arena);
+        ScoreList scores = Evaluate(v, char_num, &arena, lo, hi, budget);
+        results.assign(scores.begin(), scores.end());
+      }
+    };
+
+    class EvaluateTask : public Task {
+      const Searcher &searcher;
+      const char *query;
+      const IdxTypePtrList &v;
+      size_t char_num;
+      std::vector<ResultType> &results;
+    public:
+      EvaluateTask(const Searcher &_searcher, const char *_query,
+                   const IdxTypePtrList &_v, size_t _char_num,
+                   std::vector<ResultType> &_results)
+        : searcher(_searcher), query(_query), v(_v), char_num(_char_num),
+          results(_results) {}
+      void run(){
+        Arena &arena = Arena::for_thread();
+        ArenaScope scope(arena);
+        searcher.Score(query, Evaluate(v, char_num, &arena), results,
+                       &arena);
       }
+    };
+
+    // Runs and deletes the tasks, on the pool if there is one.
+    void RunTasks(std::vector<Task *> &tasks) const {
+      try {
+        if(pool != NULL){
+          pool->run(tasks);
+        }else{
+          for(size_t i = 0; i < tasks.size(); i++) tasks[i]->run();
+        }
+      }catch(...){
+        for(size_t i = 0; i < tasks.size(); i++) delete tasks[i];
+        tasks.clear();
+        throw;
+      }
+      for(size_t i = 0; i < tasks.size(); i++) delete tasks[i];
+      tasks.clear();
     }
 
     Searcher();
@@ -145,12 +534,150 @@ namespace nanase {
     search(const char* query) const {
       std::vector<ResultType> results;
       _Search(query, results);
-      std::sort(results.begin(), results.end(), CompareResult());
       return results;
     }
 
-    Searcher(IndexDB &_idxdb)
-      : idxdb(_idxdb) {
+    // Stops early when the budget runs out, returning the best of the
+    // documents found so far; budget.exhausted() then tells that the
+    // results are partial.
+    std::vector<ResultType>
+    search(const char* query, QueryBudget &budget) const {
+      std::vector<ResultType> results;
+      _Search(query, results, &budget);
+      return results;
+    }
+
+    // Number of matching documents. Neither scores nor reads DocInfo.
+    size_t count(const char* query) const {
+      Arena &arena = Arena::for_thread();
+      ArenaScope scope(arena);
+      size_t char_num;
+      BigramList subs = SplitQuery(query, &arena, &char_num);
+      IdxTypeList lists = IdxTypeList(ArenaAllocator<IdxType>(&arena));
+      IdxTypePtrList v = IdxTypePtrList(ArenaAllocator<const IdxType *>(&arena));
+      if(!FetchAll(subs, "", &arena, lists, v)) return 0;
+      return Verify(v, char_num, &arena).size();
+    }
+
+    // Whether any document matches. Stops at the first match.
+    bool exists(const char* query) const {
+      Arena &arena = Arena::for_thread();
+      ArenaScope scope(arena);
+      size_t char_num;
+      BigramList subs = SplitQuery(query, &arena, &char_num);
+      IdxTypeList lists = IdxTypeList(ArenaAllocator<IdxType>(&arena));
+      IdxTypePtrList v = IdxTypePtrList(ArenaAllocator<const IdxType *>(&arena));
+      if(!FetchAll(subs, "", &arena, lists, v)) return false;
+      return FindConnected(v, char_num, &arena);
+    }
+
+    // Rough number of matching documents from the size of each posting
+    // list, without reading any posting. A phrase cannot occur more
+    // often than its rarest bigram, so this is an upper bound (counting
+    // occurrences, not documents), capped by the number of documents.
+    size_t estimate_count(const char* query) const {
+      Arena &arena = Arena::for_thread();
+      ArenaScope scope(arena);
+      size_t char_num;
+      BigramList subs = SplitQuery(query, &arena, &char_num);
+      if(subs.empty()) return 0;
+      size_t estimate = static_cast<size_t>(std::max(generation, 0));
+      for(size_t i = 0; i < subs.size() && estimate > 0; i++){
+        estimate = std::min(estimate, idxdb.count_index(subs[i].ptr,
+                                                        subs[i].len, ""));
+      }
+      return estimate;
+    }
+
+    // Searches many related queries (e.g. every prefix of a phrase) at
+    // once. Each distinct bigram is fetched and decoded once for the
+    // whole batch and the lists are shared by the queries using them.
+    // With a thread pool the fetches and the queries run in parallel.
+    // Returns the results of each query in the order of the queries.
+    std::vector<std::vector<ResultType> >
+    search_batch(const std::vector<std::string> &queries) const {
+      std::vector<std::vector<ResultType> > results(queries.size());
+      std::vector<std::vector<std::string> > subs(queries.size());
+      std::vector<size_t> char_nums(queries.size());
+      std::map<std::string, size_t> list_index;
+      std::vector<std::string> keys;
+      for(size_t q = 0; q < queries.size(); q++){
+        BigramList bigrams = SplitQuery(queries[q].c_str(), NULL,
+                                        &char_nums[q]);
+        for(size_t i = 0; i < bigrams.size(); i++){
+          std::string sub(bigrams[i].ptr, bigrams[i].len);
+          subs[q].push_back(sub);
+          if(list_index.insert(std::make_pair(sub, keys.size())).second)
+            keys.push_back(sub);
+        }
+      }
+
+      std::vector<IdxType> lists(keys.size());
+      std::vector<bool> absent(keys.size());
+      std::vector<Task *> tasks;
+      for(size_t k = 0; k < keys.size(); k++){
+        absent[k] = !idxdb.may_contain_index(keys[k].data(), keys[k].size(),
+                                             "");
+        if(absent[k]) continue;
+        Bigram sub;
+        sub.ptr = keys[k].data();
+        sub.len = keys[k].size();
+        tasks.push_back(new FetchTask(*this, sub, "", lists[k]));
+      }
+      RunTasks(tasks);
+
+      std::vector<IdxTypePtrList> v(queries.size());
+      for(size_t q = 0; q < queries.size(); q++){
+        bool matchable = true;
+        for(size_t i = 0; i < subs[q].size(); i++){
+          size_t k = list_index[subs[q][i]];
+          if(absent[k]) matchable = false;
+          v[q].push_back(&lists[k]);
+        }
+        if(matchable)
+          tasks.push_back(new EvaluateTask(*this, queries[q].c_str(), v[q],
+                                           char_nums[q],
+                                           results[q]));
+      }
+      RunTasks(tasks);
+
+      return results;
+    }
+
+    // A searcher is a snapshot: it sees the documents committed when it
+    // was created (or last refreshed), whatever is indexed meanwhile.
+    Searcher(IndexDB &_idxdb, ThreadPool *_pool = NULL)
+      : idxdb(_idxdb), generation(_idxdb.committed_docid()), pool(_pool),
+        snippet_context(0), snippet_results(0),
+        aborted(_idxdb.aborted_docids(generation)) {
+    }
+
+    Searcher(IndexDB &_idxdb, int _generation, ThreadPool *_pool = NULL)
+      : idxdb(_idxdb), generation(_generation), pool(_pool),
+        snippet_context(0), snippet_results(0),
+        aborted(_idxdb.aborted_docids(generation)) {
+    }
+
+    static const size_t DEFAULT_SNIPPET_RESULTS = 10;
+
+    // The best max_results results carry a snippet of this many
+    // characters on each side of their first match, cut from the texts
+    // stored by the indexer (see IndexDB::set_store_text). 0, the
+    // default, turns snippets off.
+    void set_snippet_context(size_t chars,
+                             size_t max_results = DEFAULT_SNIPPET_RESULTS){
+      snippet_context = chars;
+      snippet_results = max_results;
+    }
+
+    int get_generation() const {
+      return generation;
+    }
+
+    // Moves the snapshot to the latest committed generation.
+    void refresh(){
+      generation = idxdb.committed_docid();
+      aborted = idxdb.aborted_docids(generation);
     }
   };
 };
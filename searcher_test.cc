@@ -0,0 +1,115 @@
+#include "indexer.hpp"
+#include "searcher.hpp"
+#include <iostream>
+#include <cstdio>
+#include <stdexcept>
+#include <pthread.h>
+using namespace std;
+using namespace nanase;
+
+static const int NDOCS = 2000;
+
+// Text of each document, made up from its docid so that the checks can
+// rebuild it without sharing anything with the indexing thread.
+string DocumentText(int docid){
+  static const char *chars[] = {
+    "a", "b", "\xe3\x81\x82", "\xe3\x81\x84", "\xe3\x81\x86",
+  };
+  unsigned int x = docid * 2654435761u;
+  string text;
+  size_t len = 3 + docid % 17;
+  for(size_t i = 0; i < len; i++){
+    x = x * 1103515245u + 12345u;
+    text += chars[(x >> 16) % 5];
+  }
+  return text;
+}
+
+struct IndexingThread {
+  IndexDB *idxdb;
+  volatile bool done;
+  bool failed;
+
+  static void *Run(void *arg){
+    IndexingThread *th = reinterpret_cast<IndexingThread *>(arg);
+    try {
+      Indexer indexer(*th->idxdb);
+      for(int docid = 1; docid <= NDOCS; docid++){
+        string text = DocumentText(docid);
+        indexer.add("u", "t", text.data(), text.size());
+      }
+    }catch(exception &e){
+      cout << e.what() << endl;
+      th->failed = true;
+    }
+    th->done = true;
+    return NULL;
+  }
+};
+
+// A searcher pinned while documents are indexed, and the write buffer
+// flushed in the background, must agree with itself and with a brute
+// force search over the documents up to its generation.
+int Check(IndexDB &idxdb){
+  // At least two characters: a single one is only indexed at the end
+  // of a document.
+  static const char *queries[] = {
+    "ab", "ba", "aab", "\xe3\x81\x82\xe3\x81\x84", "b\xe3\x81\x86",
+    "\xe3\x81\x84\xe3\x81\x86\xe3\x81\x82", "abab\xe3\x81\x82", "zz",
+  };
+  Searcher searcher(idxdb);
+  int generation = searcher.get_generation();
+
+  int failures = 0;
+  for(size_t q = 0; q < sizeof(queries) / sizeof(queries[0]); q++){
+    size_t expected = 0;
+    for(int docid = 1; docid <= generation; docid++){
+      if(DocumentText(docid).find(queries[q]) != string::npos) expected++;
+    }
+    size_t found = searcher.search(queries[q]).size();
+    size_t count = searcher.count(queries[q]);
+    bool exists = searcher.exists(queries[q]);
+    if(found != expected || count != expected || exists != (found > 0)){
+      cout << "NG: query " << q << ", generation " << generation
+           << ": search " << found << ", count " << count
+           << ", exists " << exists << ", expected " << expected << endl;
+      failures++;
+    }
+  }
+  return failures;
+}
+
+int main(int argc, char *argv[])
+{
+  const char *path = "searcher_test.idx";
+  remove(path);
+  remove("searcher_test.idx.bloom");
+
+  int failures = 0;
+  try {
+    IndexDB idxdb(path);
+    idxdb.set_write_buffer(4096, 5);
+
+    IndexingThread th;
+    th.idxdb = &idxdb;
+    th.done = th.failed = false;
+    pthread_t thread;
+    if(pthread_create(&thread, NULL, IndexingThread::Run, &th) != 0)
+      throw runtime_error("cannot create the indexing thread");
+    while(!th.done && failures == 0)
+      failures += Check(idxdb);
+    pthread_join(thread, NULL);
+    if(th.failed) failures++;
+    failures += Check(idxdb);
+
+    idxdb.close();
+  }catch(exception &e){
+    cout << e.what() << endl;
+    failures++;
+  }
+
+  remove(path);
+  remove("searcher_test.idx.bloom");
+  if(failures == 0) cout << "ok" << endl;
+  return failures == 0 ? 0 : 1;
+}
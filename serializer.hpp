@@ -44,10 +44,15 @@ namespace nanase {
       return PtrContainer<T>(ptr, len);
     }
 
+    // Buffers up to INLINE_SIZE bytes (every index key and posting
+    // record) live inside the object, so building them does not allocate.
     class Serializer {
+      static const unsigned int INLINE_SIZE = 32;
+
       unsigned int maxlen;
       unsigned int curlen;
       unsigned char* data_ptr;
+      unsigned char inline_data[INLINE_SIZE];
 
       Serializer(){}
       Serializer(const Serializer &);
@@ -82,9 +87,11 @@ namespace nanase {
       }
 
       Serializer(unsigned int _maxlen)
-        : maxlen(_maxlen), curlen(0), data_ptr(new unsigned char[_maxlen]) {}
+        : maxlen(_maxlen), curlen(0),
+          data_ptr(_maxlen <= INLINE_SIZE ? inline_data
+                   : new unsigned char[_maxlen]) {}
 
-      ~Serializer(){ delete[] data_ptr; }
+      ~Serializer(){ if(data_ptr != inline_data) delete[] data_ptr; }
 
       void *data(){ return reinterpret_cast<void *>(data_ptr); }
       unsigned int size(){ return maxlen; }
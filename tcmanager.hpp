@@ -21,9 +21,13 @@
 #ifndef TCMANAGER_HPP
 #define TCMANAGER_HPP
 
+#include <tcutil.h>
 #include <tchdb.h>
+#include <pthread.h>
 #include <cassert>
+#include <cstdlib>
 #include <exception>
+#include <new>
 #include <string>
 
 namespace nanase {
@@ -34,6 +38,74 @@ namespace nanase {
     }                                               \
   } while(0)
 
+  // Buffer of the calling thread which records are read into, so that
+  // reading a record does not allocate. It grows to the record being
+  // read; readers call shrink() when done, so a thread does not keep a
+  // huge record's worth of memory. The contents are only valid until
+  // the next read on the same thread.
+  class ReadBuffer {
+    static const size_t DEFAULT_SIZE = 4096;
+    static const size_t SHRINK_THRESHOLD = 1024 * 1024;
+
+    char *ptr;
+    size_t cap;
+
+    ReadBuffer(const ReadBuffer &);
+    ReadBuffer &operator=(const ReadBuffer &);
+
+    static void DeleteBuffer(void *buf){
+      delete reinterpret_cast<ReadBuffer *>(buf);
+    }
+
+    static pthread_key_t &Key(){
+      static pthread_key_t key;
+      return key;
+    }
+
+    static void CreateKey(){
+      pthread_key_create(&Key(), DeleteBuffer);
+    }
+
+  public:
+    ReadBuffer() : ptr(NULL), cap(0) {
+      reserve(DEFAULT_SIZE);
+    }
+
+    ~ReadBuffer(){ free(ptr); }
+
+    static ReadBuffer &for_thread(){
+      static pthread_once_t once = PTHREAD_ONCE_INIT;
+      pthread_once(&once, CreateKey);
+      ReadBuffer *buf = reinterpret_cast<ReadBuffer *>(pthread_getspecific(Key()));
+      if(buf == NULL){
+        buf = new ReadBuffer();
+        pthread_setspecific(Key(), buf);
+      }
+      return *buf;
+    }
+
+    char *data(){ return ptr; }
+    size_t capacity() const { return cap; }
+
+    void reserve(size_t n){
+      if(n <= cap) return;
+      void *p = realloc(ptr, n);
+      if(p == NULL) throw std::bad_alloc();
+      ptr = reinterpret_cast<char *>(p);
+      cap = n;
+    }
+
+    // Goes back to the default size after a record larger than
+    // SHRINK_THRESHOLD. The contents are lost.
+    void shrink(){
+      if(cap <= SHRINK_THRESHOLD) return;
+      void *p = realloc(ptr, DEFAULT_SIZE);
+      if(p == NULL) return;
+      ptr = reinterpret_cast<char *>(p);
+      cap = DEFAULT_SIZE;
+    }
+  };
+
   // This class is simple wrapper class for tokyo cabinet.
   class TCManager {
     TCHDB *hdb;
@@ -75,6 +147,37 @@ namespace nanase {
                             && tchdbecode(hdb) != TCENOREC);
     }
 
+    // Reads the value into buf, growing it if needed. Returns the size
+    // of the value, or -1 if there is no record. If the record grows
+    // while it is being read, the size it had when its size was asked
+    // is read, so appended records are never cut in the middle.
+    int read(const void *key, int ksiz, ReadBuffer &buf)
+      const throw (TCManagerException) {
+      CheckInitialized();
+      int n = tchdbget3(hdb, key, ksiz, buf.data(), buf.capacity());
+      TCMANAGER_ERROR_CHECK(n < 0 && tchdbecode(hdb) != TCESUCCESS
+                            && tchdbecode(hdb) != TCENOREC);
+      if(n < 0 || static_cast<size_t>(n) < buf.capacity()) return n;
+
+      // It may have been cut off by the size of the buffer.
+      int size = vsiz(key, ksiz);
+      if(size <= n) return n;
+      buf.reserve(size);
+      n = tchdbget3(hdb, key, ksiz, buf.data(), size);
+      TCMANAGER_ERROR_CHECK(n < 0 && tchdbecode(hdb) != TCESUCCESS
+                            && tchdbecode(hdb) != TCENOREC);
+      return n;
+    }
+
+    // Size of the value, or -1 if there is no record.
+    int vsiz(const void *key, int ksiz) const throw (TCManagerException) {
+      CheckInitialized();
+      int n = tchdbvsiz(hdb, key, ksiz);
+      TCMANAGER_ERROR_CHECK(n < 0 && tchdbecode(hdb) != TCESUCCESS
+                            && tchdbecode(hdb) != TCENOREC);
+      return n;
+    }
+
     void append(const void *key, int ksiz, const void *val, int vsiz)
       const throw (TCManagerException) {
       CheckInitialized();
@@ -96,6 +199,69 @@ namespace nanase {
       TCMANAGER_ERROR_CHECK(!tchdbput(hdb, key, ksiz, val, vsiz));
     }
 
+    // Writes the value compressed with deflate.
+    void write_deflated(const void *key, int ksiz, const void *val, int vsiz)
+      const throw (TCManagerException) {
+      CheckInitialized();
+      int size;
+      char *data = tcdeflate(reinterpret_cast<const char *>(val), vsiz, &size);
+      if(data == NULL) throw TCManagerException("deflate failed");
+      bool ok = tchdbput(hdb, key, ksiz, data, size);
+      free(data);
+      TCMANAGER_ERROR_CHECK(!ok);
+    }
+
+    // Reads a value written by write_deflated. Returns false if there is
+    // no record.
+    bool read_inflated(const void *key, int ksiz, std::string &val)
+      const throw (TCManagerException) {
+      ReadBuffer &buf = ReadBuffer::for_thread();
+      int n = read(key, ksiz, buf);
+      if(n < 0) return false;
+      int size;
+      char *data = tcinflate(buf.data(), n, &size);
+      buf.shrink();
+      if(data == NULL) throw TCManagerException("inflate failed");
+      val.assign(data, size);
+      free(data);
+      return true;
+    }
+
+    void iterinit() const throw (TCManagerException) {
+      CheckInitialized();
+      TCMANAGER_ERROR_CHECK(!tchdbiterinit(hdb));
+    }
+
+    // Returns the next key (which must be freed), or NULL at the end.
+    void *iternext(int *ksiz) const throw (TCManagerException) {
+      CheckInitialized();
+      void *key = tchdbiternext(hdb, ksiz);
+      TCMANAGER_ERROR_CHECK(key == NULL && tchdbecode(hdb) != TCESUCCESS
+                            && tchdbecode(hdb) != TCENOREC);
+      return key;
+    }
+
+    uint64_t rnum() const {
+      CheckInitialized();
+      return tchdbrnum(hdb);
+    }
+
+    uint64_t fsiz() const {
+      CheckInitialized();
+      return tchdbfsiz(hdb);
+    }
+
+    // Number of elements of the bucket array.
+    uint64_t bnum() const {
+      CheckInitialized();
+      return tchdbbnum(hdb);
+    }
+
+    const char *path() const {
+      CheckInitialized();
+      return tchdbpath(hdb);
+    }
+
     void close() throw (TCManagerException) {
       CheckInitialized();
       TCMANAGER_ERROR_CHECK(!tchdbclose(hdb));
@@ -105,6 +271,8 @@ namespace nanase {
 
     void open(const char *fname)  throw (TCManagerException) {
       TCMANAGER_ERROR_CHECK((hdb = tchdbnew()) == NULL);
+      // Searchers and indexers may share one handle among threads.
+      TCMANAGER_ERROR_CHECK(!tchdbsetmutex(hdb));
       TCMANAGER_ERROR_CHECK(!tchdbopen(hdb, fname, HDBOWRITER | HDBOCREAT));
     }
   };
@@ -0,0 +1,200 @@
+// Copyright (C) 2010 Masahiko Higashiyama
+//
+// Permission is hereby granted, free of charge, to any person obtaining a
+// copy of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#ifndef THREADPOOL_HPP
+#define THREADPOOL_HPP
+
+#include <pthread.h>
+#include <deque>
+#include <algorithm>
+#include <vector>
+#include <string>
+#include <stdexcept>
+
+namespace nanase {
+  class Task {
+  public:
+    virtual ~Task() {}
+    virtual void run() = 0;
+  };
+
+  // Fixed size pool of pthreads running Tasks in FIFO order.
+  class ThreadPool {
+    // Shared by the caller of run() and its helper tasks. The helpers
+    // may be dequeued after run() has returned, so the last one out
+    // deletes it.
+    struct Batch {
+      std::vector<Task *> tasks;
+      size_t next;
+      size_t finished;
+      int refs;
+      std::string error;
+      pthread_mutex_t mutex;
+      pthread_cond_t cond;
+
+      Batch(const std::vector<Task *> &_tasks, int _refs)
+        : tasks(_tasks), next(0), finished(0), refs(_refs) {
+        pthread_mutex_init(&mutex, NULL);
+        pthread_cond_init(&cond, NULL);
+      }
+
+      ~Batch(){
+        pthread_cond_destroy(&cond);
+        pthread_mutex_destroy(&mutex);
+      }
+
+      void Release(){
+        if(__sync_sub_and_fetch(&refs, 1) == 0) delete this;
+      }
+
+      // Runs tasks until none is left unclaimed.
+      void Drain(){
+        size_t i;
+        while((i = __sync_fetch_and_add(&next, 1)) < tasks.size()){
+          std::string err;
+          try {
+            tasks[i]->run();
+          }catch(std::exception &e){
+            err = e.what();
+          }catch(...){
+            err = "unknown error";
+          }
+          pthread_mutex_lock(&mutex);
+          if(!err.empty() && error.empty()) error = err;
+          if(++finished == tasks.size()) pthread_cond_broadcast(&cond);
+          pthread_mutex_unlock(&mutex);
+        }
+      }
+    };
+
+    class BatchHelper : public Task {
+      Batch *batch;
+    public:
+      BatchHelper(Batch *_batch) : batch(_batch) {}
+      ~BatchHelper(){ batch->Release(); }
+      void run(){ batch->Drain(); }
+    };
+
+    std::vector<pthread_t> threads;
+    std::deque<Task *> queue;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    bool stopping;
+
+    ThreadPool();
+    ThreadPool(const ThreadPool &);
+    ThreadPool &operator=(const ThreadPool &);
+
+    static void *Worker(void *arg){
+      ThreadPool *pool = reinterpret_cast<ThreadPool *>(arg);
+      Task *task;
+      while((task = pool->Pop()) != NULL){
+        // A task must report its own errors, an exception escaping
+        // it must not take the worker down.
+        try {
+          task->run();
+        }catch(...){
+        }
+        delete task;
+      }
+      return NULL;
+    }
+
+    Task *Pop(){
+      pthread_mutex_lock(&mutex);
+      while(queue.empty() && !stopping)
+        pthread_cond_wait(&cond, &mutex);
+      Task *task = NULL;
+      if(!queue.empty()){
+        task = queue.front();
+        queue.pop_front();
+      }
+      pthread_mutex_unlock(&mutex);
+      return task;
+    }
+
+  public:
+    explicit ThreadPool(size_t n) : stopping(false) {
+      pthread_mutex_init(&mutex, NULL);
+      pthread_cond_init(&cond, NULL);
+      for(size_t i = 0; i < n; i++){
+        pthread_t th;
+        if(pthread_create(&th, NULL, Worker, this) != 0){
+          shutdown();
+          throw std::runtime_error("failed to create a thread");
+        }
+        threads.push_back(th);
+      }
+    }
+
+    // Tasks already submitted are run before the threads exit.
+    ~ThreadPool(){
+      shutdown();
+      pthread_cond_destroy(&cond);
+      pthread_mutex_destroy(&mutex);
+    }
+
+    void shutdown(){
+      pthread_mutex_lock(&mutex);
+      stopping = true;
+      pthread_cond_broadcast(&cond);
+      pthread_mutex_unlock(&mutex);
+      for(size_t i = 0; i < threads.size(); i++)
+        pthread_join(threads[i], NULL);
+      threads.clear();
+    }
+
+    size_t size() const { return threads.size(); }
+
+    // The pool takes the ownership of the task and deletes it after run.
+    void submit(Task *task){
+      pthread_mutex_lock(&mutex);
+      queue.push_back(task);
+      pthread_cond_signal(&cond);
+      pthread_mutex_unlock(&mutex);
+    }
+
+    // Runs all the tasks, on the pool threads and on the calling thread,
+    // and returns when every one has finished. The tasks stay owned by
+    // the caller. The caller works through the tasks too, so this does
+    // not deadlock when called from a task while the pool is busy. If a
+    // task throws, the first error is rethrown as std::runtime_error.
+    void run(const std::vector<Task *> &tasks){
+      if(tasks.empty()) return;
+      size_t nhelpers = std::min(threads.size(), tasks.size() - 1);
+      Batch *batch = new Batch(tasks, nhelpers + 1);
+      for(size_t i = 0; i < nhelpers; i++)
+        submit(new BatchHelper(batch));
+
+      batch->Drain();
+      pthread_mutex_lock(&batch->mutex);
+      while(batch->finished < tasks.size())
+        pthread_cond_wait(&batch->cond, &batch->mutex);
+      std::string error = batch->error;
+      pthread_mutex_unlock(&batch->mutex);
+      batch->Release();
+
+      if(!error.empty()) throw std::runtime_error(error);
+    }
+  };
+};
+
+#endif /* THREADPOOL_HPP */
@@ -45,6 +45,14 @@ namespace nanase {
     return 1;
   }
 
+  // Length of the character in a text which may contain NUL: unlike
+  // utf8charlen, NUL is an ordinary character. The indexer and the
+  // snippets of stored texts must count characters alike.
+  int utf8textcharlen(const unsigned char c)
+  {
+    return (c == 0x00) ? 1 : utf8charlen(c);
+  }
+
   char *utf8substr(const char *s, int len){
     int n = 0, size = 0;
     const char *p = s;
@@ -0,0 +1,208 @@
+// Copyright (C) 2010 Masahiko Higashiyama
+//
+// Permission is hereby granted, free of charge, to any person obtaining a
+// copy of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifndef WARMER_HPP
+#define WARMER_HPP
+
+#include <pthread.h>
+#include <fstream>
+#include <map>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <stdexcept>
+#include "indexdb.hpp"
+#include "searcher.hpp"
+#include "arena.hpp"
+
+namespace nanase {
+  // Called from the warming thread.
+  class WarmProgress {
+  public:
+    virtual ~WarmProgress() {}
+    virtual void progress(size_t done, size_t total) = 0;
+    // A step which failed. Warming goes on with the next one, unless
+    // the error stopped it, in which case done never reaches total.
+    virtual void error(const std::string &) {}
+  };
+
+  // Brings the index into the page cache on a background thread, so that
+  // the first queries after a start do not fault on cold pages:
+  //
+  //   1. the header and the bucket array of the database,
+  //   2. the hottest posting lists: those of the most frequent queries of
+  //      query_log (one query per line) if given and readable, otherwise
+  //      the largest max_lists ones (see IndexDB::load_hot_keys),
+  //   3. the DocInfo of every committed document, read by scoring.
+  //
+  // Searching while warming is fine, it only competes for the disk.
+  class Warmer {
+    IndexDB &idxdb;
+    std::string query_log;
+    size_t max_lists;
+    WarmProgress *callback;
+
+    pthread_t thread;
+    bool running;
+    volatile bool cancelled;
+    size_t done;
+    size_t total;
+
+    Warmer(const Warmer &);
+    Warmer &operator=(const Warmer &);
+
+    // Reports every this many steps.
+    static const size_t PROGRESS_INTERVAL = 1024;
+
+    void Step(){
+      size_t n = __sync_add_and_fetch(&done, 1);
+      if(callback != NULL && (n % PROGRESS_INTERVAL == 0 || n == total))
+        callback->progress(n, total);
+    }
+
+    // Queries of the log, most frequent first.
+    std::vector<std::string> HotQueries() const {
+      std::ifstream in(query_log.c_str());
+      if(!in) throw std::runtime_error("cannot open " + query_log);
+      std::map<std::string, size_t> freq;
+      std::string line;
+      while(std::getline(in, line)){
+        if(!line.empty()) freq[line]++;
+      }
+
+      std::vector<std::pair<size_t, std::string> > sorted;
+      for(std::map<std::string, size_t>::iterator itr = freq.begin();
+          itr != freq.end(); ++itr)
+        sorted.push_back(std::make_pair(itr->second, itr->first));
+      std::sort(sorted.rbegin(), sorted.rend());
+      if(sorted.size() > max_lists) sorted.resize(max_lists);
+
+      std::vector<std::string> queries;
+      for(size_t i = 0; i < sorted.size(); i++)
+        queries.push_back(sorted[i].second);
+      return queries;
+    }
+
+    void Error(const std::string &what){
+      if(callback != NULL) callback->error(what);
+    }
+
+    void Run(){
+      // Replaying a query reads its posting lists the way searches do.
+      std::vector<std::string> queries, keys;
+      if(!query_log.empty()){
+        try {
+          queries = HotQueries();
+        }catch(std::exception &e){
+          Error(e.what());
+        }
+      }
+      if(queries.empty() && !idxdb.load_hot_keys(keys)){
+        keys = idxdb.largest_index_keys(max_lists, &cancelled);
+        if(!cancelled && !idxdb.save_hot_keys(keys))
+          Error("cannot save the hot keys");
+      }
+      if(keys.size() > max_lists) keys.resize(max_lists);
+      int last_docid = idxdb.committed_docid();
+      __sync_lock_test_and_set(&total, 1 + queries.size() + keys.size()
+                               + (last_docid > 0 ? last_docid : 0));
+      if(callback != NULL) callback->progress(0, total);
+
+      idxdb.prefetch_buckets(&cancelled);
+      Step();
+
+      Searcher searcher(idxdb);
+      for(size_t i = 0; i < queries.size() && !cancelled; i++){
+        searcher.count(queries[i].c_str());
+        Step();
+      }
+      for(size_t i = 0; i < keys.size() && !cancelled; i++){
+        idxdb.prefetch_index_raw(keys[i]);
+        Step();
+      }
+
+      Arena &arena = Arena::for_thread();
+      for(int docid = 1; docid <= last_docid && !cancelled; docid++){
+        ArenaScope scope(arena);
+        DocInfo docinfo(docid, &arena);
+        idxdb.read_docinfo(docinfo);
+        Step();
+      }
+    }
+
+    static void *Thread(void *arg){
+      // A failed warm-up only leaves the cache colder.
+      Warmer *warmer = reinterpret_cast<Warmer *>(arg);
+      try {
+        warmer->Run();
+      }catch(std::exception &e){
+        warmer->Error(e.what());
+      }catch(...){
+        warmer->Error("unknown error");
+      }
+      return NULL;
+    }
+
+  public:
+    static const size_t DEFAULT_MAX_LISTS = 4096;
+
+    Warmer(IndexDB &_idxdb, const std::string &_query_log = "",
+           size_t _max_lists = DEFAULT_MAX_LISTS,
+           WarmProgress *_callback = NULL)
+      : idxdb(_idxdb), query_log(_query_log), max_lists(_max_lists),
+        callback(_callback), running(false), cancelled(false),
+        done(0), total(0) {}
+
+    ~Warmer(){
+      cancel();
+    }
+
+    void start(){
+      if(running) return;
+      if(pthread_create(&thread, NULL, Thread, this) != 0)
+        throw std::runtime_error("failed to create the warming thread");
+      running = true;
+    }
+
+    // Waits until warming has finished.
+    void wait(){
+      if(!running) return;
+      pthread_join(thread, NULL);
+      running = false;
+    }
+
+    // Stops warming at the next step and waits for it.
+    void cancel(){
+      cancelled = true;
+      wait();
+    }
+
+    // Steps done and to do. total is 0 until the hot lists are chosen.
+    size_t progress_done() const {
+      return __sync_fetch_and_add(const_cast<size_t *>(&done), 0);
+    }
+
+    size_t progress_total() const {
+      return __sync_fetch_and_add(const_cast<size_t *>(&total), 0);
+    }
+  };
+};
+
+#endif /* WARMER_HPP */
@@ -0,0 +1,238 @@
+// Copyright (C) 2010 Masahiko Higashiyama
+//
+// Permission is hereby granted, free of charge, to any person obtaining a
+// copy of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#ifndef WRITEBUFFER_HPP
+#define WRITEBUFFER_HPP
+
+#include <pthread.h>
+#include <time.h>
+#include <map>
+#include <string>
+#include <stdexcept>
+#include "tcmanager.hpp"
+
+namespace nanase {
+  // In-memory segment in front of the hash database.
+  //
+  // Appends go to the active segment and are searchable at once. The
+  // flusher thread moves the active segment to the flushing one when it
+  // grows over max_bytes or gets older than max_age_ms, and appends it
+  // to the database key by key. A reader holding a ReadLock sees every
+  // record exactly once, either in the database or in a segment, because
+  // a key is appended and removed from the flushing segment under the
+  // write lock.
+  //
+  // Records still in memory are lost if the process dies.
+  class WriteBuffer {
+    typedef std::map<std::string, std::string> Segment;
+
+    const TCManager &tcm;
+    Segment active;
+    Segment flushing;
+    size_t active_bytes;
+    struct timespec active_since;
+    size_t max_bytes;
+    unsigned int max_age_ms;
+
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    pthread_rwlock_t flush_lock;
+    pthread_mutex_t flush_mutex;
+    pthread_t flusher;
+    bool running;
+    bool stopping;
+
+    WriteBuffer(const WriteBuffer &);
+    WriteBuffer &operator=(const WriteBuffer &);
+
+    static long ElapsedMillis(const struct timespec &since){
+      struct timespec now;
+      clock_gettime(CLOCK_MONOTONIC, &now);
+      return (now.tv_sec - since.tv_sec) * 1000
+        + (now.tv_nsec - since.tv_nsec) / 1000000;
+    }
+
+    bool ShouldFlush() const {
+      return active_bytes > 0 && (active_bytes >= max_bytes
+                                  || ElapsedMillis(active_since) >= max_age_ms);
+    }
+
+    static void *Flusher(void *arg){
+      WriteBuffer *buf = reinterpret_cast<WriteBuffer *>(arg);
+      unsigned int interval = buf->max_age_ms / 4;
+      if(interval == 0) interval = 1;
+      if(interval > 100) interval = 100;
+
+      pthread_mutex_lock(&buf->mutex);
+      while(!buf->stopping){
+        if(buf->ShouldFlush()){
+          pthread_mutex_unlock(&buf->mutex);
+          // A failed flush leaves its records in the flushing segment,
+          // they are retried next time and at stop().
+          try {
+            buf->flush();
+          }catch(...){
+          }
+          pthread_mutex_lock(&buf->mutex);
+          continue;
+        }
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += interval * 1000000L;
+        deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+        deadline.tv_nsec %= 1000000000L;
+        pthread_cond_timedwait(&buf->cond, &buf->mutex, &deadline);
+      }
+      pthread_mutex_unlock(&buf->mutex);
+      return NULL;
+    }
+
+  public:
+    class ReadLock {
+      WriteBuffer &buf;
+      ReadLock(const ReadLock &);
+      ReadLock &operator=(const ReadLock &);
+    public:
+      ReadLock(WriteBuffer &_buf) : buf(_buf) {
+        pthread_rwlock_rdlock(&buf.flush_lock);
+      }
+      ~ReadLock(){ pthread_rwlock_unlock(&buf.flush_lock); }
+    };
+
+    WriteBuffer(const TCManager &_tcm)
+      : tcm(_tcm), active_bytes(0), max_bytes(0), max_age_ms(0),
+        running(false), stopping(false) {
+      pthread_mutex_init(&mutex, NULL);
+      pthread_cond_init(&cond, NULL);
+      pthread_rwlock_init(&flush_lock, NULL);
+      pthread_mutex_init(&flush_mutex, NULL);
+    }
+
+    ~WriteBuffer(){
+      pthread_mutex_destroy(&flush_mutex);
+      pthread_rwlock_destroy(&flush_lock);
+      pthread_cond_destroy(&cond);
+      pthread_mutex_destroy(&mutex);
+    }
+
+    bool enabled() const { return running; }
+
+    void start(size_t _max_bytes, unsigned int _max_age_ms){
+      if(running) stop();
+      max_bytes = _max_bytes;
+      max_age_ms = _max_age_ms;
+      stopping = false;
+      if(pthread_create(&flusher, NULL, Flusher, this) != 0)
+        throw std::runtime_error("failed to create the flusher thread");
+      running = true;
+    }
+
+    // Stops the flusher and writes everything left to the database.
+    void stop(){
+      if(!running) return;
+      pthread_mutex_lock(&mutex);
+      stopping = true;
+      pthread_cond_signal(&cond);
+      pthread_mutex_unlock(&mutex);
+      pthread_join(flusher, NULL);
+      running = false;
+      flush();
+    }
+
+    void append(const void *key, size_t ksiz, const void *val, size_t vsiz){
+      pthread_mutex_lock(&mutex);
+      if(active_bytes == 0) clock_gettime(CLOCK_MONOTONIC, &active_since);
+      active[std::string(reinterpret_cast<const char *>(key), ksiz)]
+        .append(reinterpret_cast<const char *>(val), vsiz);
+      active_bytes += ksiz + vsiz;
+      if(active_bytes >= max_bytes) pthread_cond_signal(&cond);
+      pthread_mutex_unlock(&mutex);
+    }
+
+    // Appends the buffered records of the key to out, oldest first.
+    // The caller must hold a ReadLock across this and its database read.
+    void lookup(const void *key, size_t ksiz, std::string &out){
+      std::string k(reinterpret_cast<const char *>(key), ksiz);
+      pthread_mutex_lock(&mutex);
+      Segment::const_iterator itr = flushing.find(k);
+      if(itr != flushing.end()) out += itr->second;
+      itr = active.find(k);
+      if(itr != active.end()) out += itr->second;
+      pthread_mutex_unlock(&mutex);
+    }
+
+    // Number of buffered bytes of the key.
+    size_t size(const void *key, size_t ksiz){
+      std::string k(reinterpret_cast<const char *>(key), ksiz);
+      size_t n = 0;
+      pthread_mutex_lock(&mutex);
+      Segment::const_iterator itr = flushing.find(k);
+      if(itr != flushing.end()) n += itr->second.size();
+      itr = active.find(k);
+      if(itr != active.end()) n += itr->second.size();
+      pthread_mutex_unlock(&mutex);
+      return n;
+    }
+
+    void flush(){
+      pthread_mutex_lock(&flush_mutex);
+      pthread_mutex_lock(&mutex);
+      // Left over from a failed flush, the active records are newer.
+      for(Segment::iterator itr = active.begin(); itr != active.end(); ++itr)
+        flushing[itr->first] += itr->second;
+      active.clear();
+      active_bytes = 0;
+      pthread_mutex_unlock(&mutex);
+
+      try {
+        for(;;){
+          pthread_rwlock_wrlock(&flush_lock);
+          pthread_mutex_lock(&mutex);
+          if(flushing.empty()){
+            pthread_mutex_unlock(&mutex);
+            pthread_rwlock_unlock(&flush_lock);
+            break;
+          }
+          std::string key = flushing.begin()->first;
+          std::string val = flushing.begin()->second;
+          pthread_mutex_unlock(&mutex);
+
+          try {
+            tcm.append(key.data(), key.size(), val.data(), val.size());
+          }catch(...){
+            pthread_rwlock_unlock(&flush_lock);
+            throw;
+          }
+          pthread_mutex_lock(&mutex);
+          flushing.erase(key);
+          pthread_mutex_unlock(&mutex);
+          pthread_rwlock_unlock(&flush_lock);
+        }
+      }catch(...){
+        pthread_mutex_unlock(&flush_mutex);
+        throw;
+      }
+      pthread_mutex_unlock(&flush_mutex);
+    }
+  };
+};
+
+#endif /* WRITEBUFFER_HPP */